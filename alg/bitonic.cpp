@@ -16,34 +16,99 @@
 name_t bitonic::permute(name_t arr)
 {
     //pi->new_seed();
-    uint32_t i,j,k,l;
-    element *el, *ek;
-    uint32_t randk, randl;
-    for (i = 2; i <= size; i*=2) {
-        for (j = i/2; j > 0 ; j/=2) {
-            for (k = 0; k < size; ++k) {
-                l = k^j;
-                if(l > k) {
-                    // retrieve elements
-                    ek = cloud->get(arr, k);
-                    el = cloud->get(arr, l);
-                    // hash the keys
-                    randk = pi->eval_perm(ek->key);
-                    randl = pi->eval_perm(el->key);
-                    // route according to the order of the hash values
-                    if( (((i & k) == 0) && (randk > randl))
-                        || (((i & k) != 0) && (randk < randl))) {
-                        // swap the elements
-                        cloud->put(arr, k, el);
-                        cloud->put(arr, l, ek);
-                    } else {
-                        cloud->put(arr, k, ek);
-                        cloud->put(arr, l, el);
-                    }
-                }
-            }
+    // the first pass hashes the keys into the tags and the last pass clears the tags
+    return network(arr, true);
+}
+
+name_t bitonic::sort(name_t arr)
+{
+    return network(arr, false);
+}
+
+name_t bitonic::network(name_t arr, bool hash)
+{
+    // merges of at most one chunk are applied in client memory
+    merge_chunks(arr, 2, chunk, hash, hash && chunk == padded);
+    for (uint32_t i = 2*chunk; i <= padded; i*=2) {
+        // strides of at least one chunk compare elements of different chunks
+        strided_stage(arr, i-1);
+        for (uint32_t j = i/4; j >= chunk; j/=2) {
+            strided_stage(arr, j);
         }
+        // the remaining strides of the merge are applied in client memory
+        merge_chunks(arr, i, i, false, hash && i == padded);
     }
     return arr;
 }
 
+void bitonic::strided_stage(name_t arr, uint32_t mask)
+{
+    // pairs are independent, so each worker applies the pairs of a range of lower indices
+    parallel_for(pool, 0, size, [&](uint64_t lo, uint64_t hi) {
+        uint32_t k,l;
+        element *el, *ek;
+        for (k = lo; k < hi; ++k) {
+            l = k^mask;
+            if(l > k && l < size) {
+                // retrieve elements
+                ek = cloud->get(arr, k);
+                el = cloud->get(arr, l);
+                // route according to the order of the tags
+                if((uint32_t) ek->aux > (uint32_t) el->aux) {
+                    // swap the elements
+                    cloud->put(arr, k, el);
+                    cloud->put(arr, l, ek);
+                } else {
+                    cloud->put(arr, k, ek);
+                    cloud->put(arr, l, el);
+                }
+            }
+        }
+    });
+}
+
+void bitonic::merge_chunks(name_t arr, uint32_t first, uint32_t last, bool hash, bool clear)
+{
+    uint32_t num_chunks = (size + chunk - 1) / chunk;
+    parallel_for(pool, 0, num_chunks, [&](uint64_t lo, uint64_t hi) {
+        std::vector<element*> block(chunk);
+        std::vector<uint64_t> words(chunk);
+        for (uint64_t c = lo; c < hi; ++c) {
+            merge_chunk(arr, c*chunk, first, last, hash, clear, block.data(), words.data());
+        }
+    });
+}
+
+void bitonic::merge_chunk(name_t arr, uint32_t offset, uint32_t first, uint32_t last, bool hash, bool clear,
+        element **block, uint64_t *words)
+{
+    // retrieve the chunk and pack the tag of each element with its position in the chunk
+    uint32_t count = std::min(chunk, size - offset);
+    for (uint32_t k = 0; k < count; ++k) {
+        block[k] = cloud->get(arr, offset + k);
+        if(hash) {
+            block[k]->aux = pi->eval_perm(block[k]->key);
+        }
+        words[k] = pack_tag((uint32_t) block[k]->aux, k);
+    }
+    std::fill(words + count, words + chunk, VIRTUAL_WORD);
+
+    for (uint32_t i = first; i <= last; i*=2) {
+        // the first stage of a merge within the chunk, then the strides that stay within the chunk
+        if(i <= chunk) {
+            bitonic_flip_stage(words, chunk, i);
+        }
+        for (uint32_t j = std::min(i/2, chunk)/2; j > 0; j/=2) {
+            bitonic_half_stage(words, chunk, j);
+        }
+    }
+    // place the chunk at the server in sorted order
+    element *e;
+    for (uint32_t k = 0; k < count; ++k) {
+        e = block[packed_position(words[k])];
+        if(clear) {
+            e->aux = 0;
+        }
+        cloud->put(arr, offset + k, e);
+    }
+}
@@ -1,5 +1,3 @@
-#include <random>
-
 /********************************************************************
  Implementation of Bucket Oblivious Permutation
 
@@ -15,183 +13,274 @@
 #include <tgmath.h>
 #include <vector>
 #include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
 #include "../headers/bucket.h"
 
 name_t bucket::permute(name_t arr)
 {
-    seed+=2;
+    if(!resuming) {
+        start_level = 0;
+        overflow = false;
+    }
+    retries = 0;
+    // the input is kept until the butterfly network completes without an overflow
+    name_t input = arr - start_level;
     arr = butterfly(arr);
-    // rearrange (non-obliviously) according to the input permutation.
-    arr = rearrange(arr);
+    while (overflow) {
+        if(retries == BUCKET_MAX_RETRIES) {
+            // with a capacity below capacity(), the runs could overflow indefinitely
+            fprintf(stderr, "bucket overflow: %u runs overflowed with Z = %u (capacity %u is required)\n",
+                    retries + 1, Z, capacity(size, k, BUCKET_FAILURE));
+            exit(1);
+        }
+        // repeat the run from the input with a new permutation (the accesses of the failed run are
+        // independent of the elements, so only the fact that it failed is revealed)
+        cloud->delete_array(arr);
+        pi->new_seed();
+        start_level = 0;
+        overflow = false;
+        resuming = false;
+        retries++;
+        if(checkpoints != nullptr) {
+            // the last checkpoint holds the previous permutation, whose arrays are overwritten by the new run
+            save_checkpoint(0, input);
+        }
+        arr = butterfly(input);
+    }
+    cloud->delete_array(input);
+
+    resuming = false;
+    if(checkpoints != nullptr) {
+        checkpoints->clear();
+    }
     return arr;
 }
 
-name_t bucket::butterfly(name_t arr)
+name_t bucket::resume(name_t arr)
+{
+    checkpoint *cp = (checkpoints != nullptr) ? checkpoints->load(BUCKET_CHECKPOINT, size) : nullptr;
+    if(cp == nullptr) {
+        return permute(arr);
+    }
+    pi->set_seed(cp->read<unsigned>());
+    start_level = cp->read<uint32_t>();
+    arr = cp->read<name_t>();
+    overflow = cp->read<bool>();
+    delete cp;
+
+    resuming = true;
+    return permute(arr);
+}
+
+void bucket::save_checkpoint(uint32_t level, name_t arr)
+{
+    checkpoint cp;
+    cp.write(pi->get_seed());
+    cp.write(level);
+    cp.write(arr);
+    cp.write((bool) overflow);
+    write_checkpoint(cp, BUCKET_CHECKPOINT, size);
+}
+
+uint32_t bucket::num_buckets(uint32_t n, uint32_t Z)
 {
     // largest power of two larger than 2n/Z
-    B = ceil(2*size/(double)Z);
+    uint32_t B = ceil(2*n/(double)Z);
     uint32_t zeros = __builtin_clz(B);
     uint32_t msb = 32 - zeros;
     // check if B is a power of two
     if((B & (B - 1)) != 0) {
         B = 1u << msb;
     }
+    return B;
+}
 
-    // for the first split, the input array has no dummies
-    auto in_left = new std::vector<element *>(),
-            in_right = new std::vector<element *>(),
-            out_left = new std::vector<element *>(),
-            out_right = new std::vector<element *>();
-
-    uint32_t width, jprime, count = 0;
-    for (uint32_t i = 0; i < msb-1; ++i) {
-        cloud->create_array(arr+1, B*Z);
-        for (int j = 0; j < B/2; ++j) {
-
-            if (i == 0) {
-                // first round the input array has no dummies
-                width = Z/2;
-            } else {
-                width = Z;
-            }
-            jprime = j / (1u << i) * (1u << (i));
-            // get buckets from the server
-            get_bucket(arr, width, (j + jprime) * width, in_left);
-            get_bucket(arr, width, (j + jprime + (1u << i)) * width, in_right);
-
-            // split two buckets according to random tags
-            split_input_bucket(in_left, out_right, out_left, i);
-            split_input_bucket(in_right, out_right, out_left, i);
-
-            if(i == (msb -2))
-            {
-                // dummies need to be removed and buckets shuffled
-                count = final_round(out_left, out_right, arr+1, count);
-            } else {
-                // place buckets on the server
-                put_bucket(arr+1, 2*j*Z, out_left);
-                put_bucket(arr+1, (2*j+1)*Z, out_right);
+uint32_t bucket::capacity(uint32_t n, uint32_t k, double failure)
+{
+    uint32_t log_k = __builtin_ctz(k), log_B, levels;
+    // the failure bound decreases with Z, so the smallest capacity is found by a linear search
+    for (uint32_t Z = 2; ; Z += 2) {
+        log_B = __builtin_ctz(num_buckets(n, Z));
+        levels = std::max((log_B + log_k - 1) / log_k, 1u);
+        if(num_buckets(n, Z) * (double) levels * exp(-(double) Z / 6) <= failure) {
+            return Z;
+        }
+    }
+}
+
+name_t bucket::butterfly(name_t arr)
+{
+    B = num_buckets(size, Z);
+    // each level routes log_k bits of the tags (the last level may route fewer)
+    uint32_t log_B = __builtin_ctz(B);
+    num_levels = std::max((log_B + log_k - 1) / log_k, 1u);
+    set_bucket_tags();
+
+    if(resuming) {
+        // the input of the first level to be routed was written by the interrupted run
+        cloud->open_array(arr, (start_level == 0 || start_level == num_levels) ? size : B*Z);
+        if(start_level > 0) {
+            // the input is kept in case the run is repeated
+            cloud->open_array(arr - start_level, size);
+        }
+    }
+
+    uint32_t width, shift, bits, radix, stride;
+    for (uint32_t i = start_level; i < num_levels; ++i) {
+        // the final level writes the output array
+        cloud->create_array(arr+1, (i == num_levels-1) ? size : B*Z);
+        if (i == 0) {
+            // first round the input array has no dummies
+            width = Z/2;
+        } else {
+            width = Z;
+        }
+        shift = i*log_k;
+        bits = std::min(log_k, log_B - shift);
+        radix = 1u << bits;
+        // the input buckets of a step are stride buckets apart
+        stride = 1u << shift;
+        // steps read and write disjoint buckets (parallel_for returns once the level is complete)
+        parallel_for(pool, 0, B/radix, [&](uint64_t lo, uint64_t hi) {
+            std::vector<element *> input;
+            // record buffer of one bucket
+            std::vector<char> records((size_t) Z*BYTESPERELEM);
+            std::vector<std::vector<element *>> out(radix);
+            uint32_t first;
+            for (uint32_t j = lo; j < hi; ++j) {
+                first = j / stride * stride * radix + j % stride;
+                // get buckets from the server and split them according to their tags
+                for (uint32_t t = 0; t < radix; ++t) {
+                    get_bucket(arr, width, (first + t*stride) * width, &input, records.data());
+                    split_input_bucket(&input, &out, shift, bits);
+                }
+
+                if(i == num_levels-1)
+                {
+                    // dummies need to be removed and buckets sorted
+                    final_round(&out, arr+1, records.data());
+                } else {
+                    // place buckets on the server
+                    for (uint32_t d = 0; d < radix; ++d) {
+                        put_bucket(arr+1, (radix*j + d)*Z, &out[d], records.data());
+                    }
+                }
             }
+        });
+        // increment array (the input is kept in case the run is repeated)
+        if(i > 0) {
+            cloud->delete_array(arr);
         }
-        // increment array
-        cloud->delete_array(arr);
         arr++;
+        if(checkpoint_due()) {
+            save_checkpoint(i+1, arr);
+        }
     }
     return arr;
 }
 
-uint32_t bucket::final_round(std::vector<element *> *left, std::vector<element *> *right,
-        name_t arr, uint32_t count) {
-    element *e;
-    // after dummies are removed, randomly shuffle the buckets before placing at the server
-    std::shuffle(left->begin(), left->end(), std::mt19937(std::random_device()()));
-    std::shuffle(right->begin(), right->end(), std::mt19937(std::random_device()()));
-
-    uint32_t card = left->size();
-    // upload real elements
-    for (int i = 0; i < card; ++i) {
-        e = left->at(i);
-        cloud->put(arr, count+i, e);
-    }
-    count += card;
-    card = right->size();
-    // upload real elements
-    for (int i = 0; i < card; ++i) {
-        e = right->at(i);
-        cloud->put(arr, count+i, e);
+void bucket::set_bucket_tags()
+{
+    uint32_t log_B = __builtin_ctz(B);
+    uint32_t shift, bits, radix, stride, j, x;
+    // follow each tag through the network to the final bucket that it reaches
+    bucket_tags.resize(B);
+    for (uint32_t tag = 0; tag < B; ++tag) {
+        x = 0;
+        for (uint32_t i = 0; i < num_levels; ++i) {
+            shift = i*log_k;
+            bits = std::min(log_k, log_B - shift);
+            radix = 1u << bits;
+            stride = 1u << shift;
+            // the step that reads bucket x, and the bucket that it writes the tag to
+            j = x / (stride*radix) * stride + x % stride;
+            x = radix*j + ((tag >> shift) & (radix - 1));
+        }
+        bucket_tags[x] = tag;
     }
-    count+=card;
-    left->clear();
-    right->clear();
-    return count;
 }
 
-name_t bucket::rearrange(name_t arr)
-{
-    // non-oblivious algorithm for applying a permutation to an array
-    cloud->create_array(arr+1, size);
-    element *e;
-    uint32_t index;
-    for (int i = 0; i < size; ++i) {
-        e = cloud->get(arr, i);
-        index = pi->eval_perm(e->key);
-        cloud->put(arr+1, index, e);
+void bucket::final_round(std::vector<std::vector<element *>> *out, name_t arr, char *records) {
+    // after dummies are removed, sort the buckets by destination. The buckets of a step cover
+    // consecutive ranges of destinations, so the elements are placed in one sequential run
+    for (std::vector<element *> &buck : *out) {
+        std::sort(buck.begin(), buck.end(), [](element *x, element *y) {
+            return x->aux < y->aux;
+        });
+        // upload real elements (a bucket holds at most Z/2 elements, and the destinations of
+        // a bucket are consecutive unless the run overflowed)
+        uint32_t count = 0, first = 0;
+        for (element *e : buck) {
+            if(count > 0 && e->aux != first + count) {
+                cloud->put_records(arr, first, count, records);
+                count = 0;
+            }
+            if(count == 0) {
+                first = e->aux;
+            }
+            e->aux = 0;
+            server::to_record(e, records + (size_t) count*BYTESPERELEM);
+            count++;
+            delete e;
+        }
+        if(count > 0) {
+            cloud->put_records(arr, first, count, records);
+        }
+        buck.clear();
     }
-    // increment array
-    cloud->delete_array(arr);
-    arr++;
-    return arr;
 }
 
-void bucket::get_bucket(name_t arr, uint32_t width, uint32_t offset, std::vector<element *> *buck)
+void bucket::get_bucket(name_t arr, uint32_t width, uint32_t offset, std::vector<element *> *buck, char *records)
 {
     buck->clear();
 
-    uint32_t length = B*Z;
-    element* e;
-    // get bucket from the server
-    for (int i = offset; i < width + offset && i < length; ++i) {
-        if(cloud->check(arr, i)) {
-            e = cloud->get(arr, i);
-            if(e->key != INT32_MAX)
-            {
-                buck->push_back(e);
-            } else {
-                // remove dummies
-                delete e;
-            }
+    // get bucket from the server (the input array of the first level is shorter than B*Z/2)
+    uint32_t count = cloud->get_records(arr, offset, width, records);
+    char const *record;
+    for (uint32_t i = 0; i < count; ++i) {
+        record = records + (size_t) i*BYTESPERELEM;
+        // dummies are skipped without creating an element
+        if(server::record_key(record) != DUMMY_KEY) {
+            buck->push_back(cloud->to_element(record));
         }
     }
 }
 
-void bucket::put_bucket(name_t arr, uint32_t offset, std::vector<element *> *buck)
+void bucket::put_bucket(name_t arr, uint32_t offset, std::vector<element *> *buck, char *records)
 {
-    element *e;
     uint32_t card = buck->size();
 
-    // check if bucket overflows
+    // check if bucket overflows (the run is repeated, so the extra elements are discarded)
     if (card > Z) {
-        printf("overflow ABORT\n");
-        exit(1);
+        overflow = true;
+        card = Z;
     }
-    // upload real elements
-    for (int i = 0; i <  card; ++i) {
-        e = buck->at(i);
-        cloud->put(arr, offset+i, e);
+    // real elements are followed by dummy records
+    memset(records + (size_t) card*BYTESPERELEM, DUMMY_BYTE, (size_t) (Z - card)*BYTESPERELEM);
+    for (uint32_t i = 0; i < card; ++i) {
+        server::to_record(buck->at(i), records + (size_t) i*BYTESPERELEM);
     }
-    // upload dummy elements
-    for (int i =  card; i < Z; ++i) {
-        cloud->put(arr, offset+i, new element(INT32_MAX, 0, nullptr));
+    for (element *e : *buck) {
+        delete e;
     }
+    // upload the bucket
+    cloud->put_records(arr, offset, Z, records);
     buck->clear();
 }
 
-void bucket::split_input_bucket(std::vector<element *> *input, std::vector<element *> *out_right,
-                                std::vector<element *> *out_left, uint32_t i) {
+void bucket::split_input_bucket(std::vector<element *> *input, std::vector<std::vector<element *>> *out,
+                                uint32_t shift, uint32_t bits) {
     uint32_t tag;
-    // split the input into two buckets based on permutation tags
+    // split the input into buckets based on permutation tags
     for( element *e : *input) {
-        // check if dummy
-        if(e->key != UINT32_MAX) {
-            // get random tag
-            MurmurHash3_x86_32((char *) &e->key, sizeof(int), seed, &tag);
-            tag %= B;
-            if (tag & (1u << i)) {
-                out_right->push_back(e);
-            } else {
-                out_left->push_back(e);
-            }
+        if(shift == 0) {
+            // the destination is computed once and carried in the auxiliary information
+            e->aux = pi->eval_perm(e->key);
         }
+        // the tag of the final bucket that covers the destination
+        tag = bucket_tags[(uint64_t) e->aux * B / size];
+        out->at((tag >> shift) & ((1u << bits) - 1)).push_back(e);
     }
 }
-
-
-
-
-
-
-
-
-
-
-
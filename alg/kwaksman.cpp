@@ -0,0 +1,260 @@
+/********************************************************************
+ Implementation of a radix-k oblivious permutation based on the
+ Waksman/Benes network.
+
+ The binary network of waksman.cpp is generalised to k x k switches.
+ The exterior of a node forms a k-regular bipartite multigraph and is
+ configured by an edge colouring that repeatedly applies the cycle
+ traversal of waksman::set_exterior.
+
+ MIT License
+ Copyright (c) 2021 William Holland
+ *********************************************************************/
+
+#include "../headers/kwaksman.h"
+
+#define NONE UINT32_MAX
+
+name_t kwaksman::permute(name_t name)
+{
+    // allocate temporary storage. The input array can be reused if the network is not padded
+    input = name;
+    temp1 = name+1;
+    cloud->create_array(temp1, padded);
+    if(padded == length) {
+        temp2 = name;
+    } else {
+        temp2 = name+2;
+        cloud->create_array(temp2, padded);
+    }
+
+    configuration_phase(new radix_node(nullptr, 0, 0, padded), input);
+
+    // leaves are written to the opposite array of their parents
+    name_t source = (num_levels & 1u) ? temp2 : temp1;
+    name_t output = empty_road_phase(source);
+
+    // delete unused array
+    cloud->delete_array((output == temp1) ? temp2 : temp1);
+
+    // virtual dummies are mapped to themselves, so they occupy the padding at the end of the output
+    if(padded != length) {
+        cloud->truncate_array(output, length);
+    }
+    return output;
+}
+
+void kwaksman::configuration_phase(radix_node *node, name_t source)
+{
+    // at each level the procedure alternates between temporary arrays
+    name_t target = (source == temp1) ? temp2 : temp1;
+    uint32_t offset = node->offset;
+    uint32_t size = node->size;
+
+    if(size == leaf_size) {
+        // leaf node reached
+        route_leaf(node, source, target);
+        delete node;
+        if(source != temp1 && source != temp2) {
+            cloud->delete_array(source);
+        }
+        return;
+    }
+
+    uint32_t num_switches = size / k;
+
+    // the subpermutation is evaluated once for each edge, and inverted for the exit switches
+    sigma.resize(size);
+    inv_sigma.resize(size);
+    for (uint32_t x = 0; x < size; ++x) {
+        sigma[x] = eval_sigma(node, x);
+        inv_sigma[sigma[x]] = x;
+    }
+
+    // configure the entry switches
+    auto colour = new std::vector<uint8_t>(size);
+    colour_edges(colour);
+
+    // route elements through the entry switches. A switch is a contiguous group of k elements and
+    // its outputs are written to the k subnetworks in a fixed order
+    node->entry_port.resize(size);
+    std::vector<element *> block(k);
+    element *e;
+    for (uint32_t i = 0; i < num_switches; ++i) {
+        for (uint32_t p = 0; p < k; ++p) {
+            uint32_t x = i*k + p;
+            uint32_t value = sigma[x];
+            uint32_t c = colour->at(x);
+            node->entry_port[i*k + c] = p;
+
+            e = get_elem(source, offset + x);
+            // add the exit port to the auxiliary information
+            e->aux <<= log_k;
+            e->aux |= value & (k - 1);
+            block[c] = e;
+        }
+        for (uint32_t c = 0; c < k; ++c) {
+            cloud->put(target, offset + c*num_switches + i, block[c]);
+        }
+    }
+    delete colour;
+
+    // the input array is no longer required once the root is routed
+    if(source != temp1 && source != temp2) {
+        cloud->delete_array(source);
+    }
+
+    // recurse according to a preorder traversal. The subpermutation of subnetwork c maps an entry
+    // switch to the exit switch of its c-coloured edge
+    for (uint32_t c = 0; c < k; ++c) {
+        configuration_phase(new radix_node(node, c, offset + c*num_switches, num_switches), target);
+    }
+    delete node;
+}
+name_t kwaksman::empty_road_phase(name_t source)
+{
+    name_t dest = (source == temp1) ? temp2 : temp1;
+    std::vector<element *> block(k);
+    element *e;
+
+    // perform a reverse level-order traversal. Nodes of a level are contiguous and of equal size
+    uint32_t size = leaf_size;
+    for (uint32_t level = 0; level < num_levels; ++level) {
+        size *= k;
+        uint32_t num_switches = size / k;
+        for (uint32_t offset = 0; offset < padded; offset += size) {
+            for (uint32_t i = 0; i < num_switches; ++i) {
+                // exit switch i receives output i of each subnetwork
+                for (uint32_t c = 0; c < k; ++c) {
+                    e = cloud->get(source, offset + c*num_switches + i);
+                    // remove the port of the current switch from the auxiliary information
+                    block[e->aux & (k - 1)] = e;
+                    e->aux >>= log_k;
+                }
+                for (uint32_t p = 0; p < k; ++p) {
+                    cloud->put(dest, offset + i*k + p, block[p]);
+                }
+            }
+        }
+        // alternate the temporary arrays
+        std::swap(source, dest);
+    }
+    return source;
+}
+
+void kwaksman::colour_edges(std::vector<uint8_t> *colour)
+{
+    uint32_t size = colour->size();
+    std::vector<bool> visited(size);
+
+    // each round splits every colour class of degree d into two classes of degree d/2
+    for (uint32_t bit = 0; bit < log_k; ++bit) {
+        uint32_t mask = (1u << bit) - 1;
+
+        // traverse the cycles, alternating between entry and exit pairs, and 2-colour the edges.
+        // A pair of edges at an entry switch (resp. exit switch) plays the role of the two wires of a
+        // binary switch
+        visited.assign(size, false);
+        for (uint32_t start = 0; start < size; ++start) {
+            if(visited[start]) {
+                continue;
+            }
+            uint32_t cur = start;
+            bool inv = true;
+            uint32_t setting = 0;
+            do {
+                visited[cur] = true;
+                colour->at(cur) |= setting << bit;
+                cur = inv ? entry_partner(cur, colour, mask) : exit_partner(cur, colour, mask);
+                inv = !inv;
+                setting ^= 1u;
+            } while(cur != start);
+        }
+    }
+}
+
+uint32_t kwaksman::entry_partner(uint32_t index, std::vector<uint8_t> *colour, uint32_t mask)
+{
+    // pair the edges of the class at the entry switch in port order
+    uint32_t cls = colour->at(index) & mask;
+    uint32_t first = index & ~(k - 1);
+    uint32_t pending = NONE;
+    for (uint32_t x = first; x < first + k; ++x) {
+        if((colour->at(x) & mask) != cls) {
+            continue;
+        }
+        if(pending == NONE) {
+            pending = x;
+        } else {
+            if(pending == index) {
+                return x;
+            }
+            if(x == index) {
+                return pending;
+            }
+            pending = NONE;
+        }
+    }
+    return NONE;
+}
+
+uint32_t kwaksman::exit_partner(uint32_t index, std::vector<uint8_t> *colour, uint32_t mask)
+{
+    // pair the edges of the class at the exit switch in port order
+    uint32_t cls = colour->at(index) & mask;
+    uint32_t first = sigma[index] & ~(k - 1);
+    uint32_t pending = NONE;
+    for (uint32_t y = first; y < first + k; ++y) {
+        uint32_t x = inv_sigma[y];
+        if((colour->at(x) & mask) != cls) {
+            continue;
+        }
+        if(pending == NONE) {
+            pending = x;
+        } else {
+            if(pending == index) {
+                return x;
+            }
+            if(x == index) {
+                return pending;
+            }
+            pending = NONE;
+        }
+    }
+    return NONE;
+}
+
+void kwaksman::route_leaf(radix_node *node, name_t source, name_t dest)
+{
+    uint32_t size = node->size;
+    std::vector<element *> block(size);
+
+    // retrieve the leaf and permute in client memory
+    for (uint32_t i = 0; i < size; ++i) {
+        block[eval_sigma(node, i)] = get_elem(source, node->offset + i);
+    }
+    // place elements in output order
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud->put(dest, node->offset + i, block[i]);
+    }
+}
+
+element *kwaksman::get_elem(name_t source, uint32_t index)
+{
+    if(source == input && index >= length) {
+        // virtual dummy of the padded network
+        return new element(DUMMY_KEY, 0, nullptr);
+    }
+    return cloud->get(source, index);
+}
+
+uint32_t kwaksman::eval_sigma(radix_node *node, uint32_t index)
+{
+    radix_node *parent = node->parent;
+    if(parent == nullptr) {
+        // at the root node, apply the input permutation function
+        return (index < length) ? pi->eval_perm(index) : index;
+    }
+    // the input is the edge of its entry switch in the parent that is routed to the node
+    return eval_sigma(parent, index*k + parent->entry_port[index*k + node->colour]) / k;
+}
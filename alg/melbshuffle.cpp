@@ -10,248 +10,339 @@
  Copyright (c) 2021 William Holland
  *********************************************************************/
 
-#include <map>
 #include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
 #include <assert.h>
 #include "../headers/melbshuffle.h"
 
-static bool compare(element *x, element *y) {
-    return x->aux < y->aux;
-}
-
 name_t melbshuffle::permute(name_t input)
 {
+    if(!resuming) {
+        start_pass = 0;
+        start_phase = 0;
+        overflow = false;
+    }
+    retries = 0;
+    this->input = input;
     name_t output = input+1;
 
-    // create the temporary arrays and the output array
-    cloud->create_array(Ta, (num_chunks)*chunk_width*p1);
-    cloud->create_array(Tb, (num_chunks)*chunk_width*p2);
-    cloud->create_array(output, size);
-
-    // shuffle the input
-    shuffle_pass(input, Ta, Tb, output);
-
-    // delete temporary storage and the input array
-    cloud->delete_array(Ta);
-    cloud->delete_array(Tb);
-    cloud->delete_array(input);
-
-    pi->new_seed();
-    // create temporary and output storage for the next shuffle
-    cloud->create_array(Tc, (num_chunks)*chunk_width*p1);
-    cloud->create_array(Td, (num_chunks)*chunk_width*p2);
-    output++;
-    cloud->create_array(output, size);
+    for (uint32_t pass = start_pass; pass < 2; ++pass) {
+        // create the temporary arrays (phase l places a bin of each of its segments in each subgroup)
+        name_t T = MELB_TEMP + pass*c;
+        for (uint32_t l = 0; l < c; ++l) {
+            prepare_array(T + l, phases[l].groups*phases[l].radix*phases[l].segments*phases[l].max_load);
+        }
+        // create the output array
+        output = input + pass + 1;
+        prepare_array(output, size);
+
+        // shuffle the input of the pass
+        shuffle_pass(output-1, T, output, pass);
+
+        if(pass == 0) {
+            pi->new_seed();
+            // the arrays of the next shuffle are created from scratch
+            resuming = false;
+            start_phase = 0;
+            if(checkpoints != nullptr) {
+                // the last checkpoint refers to the arrays of the first pass, which are deleted
+                save_checkpoint(1, 0);
+            }
+        }
 
-    shuffle_pass(output-1, Tc, Td, output);
-    cloud->delete_array(Tc);
-    cloud->delete_array(Td);
-    cloud->delete_array(output-1);
+        // delete temporary storage and the input of the pass
+        for (uint32_t l = 0; l < c; ++l) {
+            cloud->delete_array(T + l);
+        }
+        cloud->delete_array(output-1);
+    }
 
+    resuming = false;
+    if(checkpoints != nullptr) {
+        checkpoints->clear();
+    }
     return output;
 }
 
-void melbshuffle::shuffle_pass(name_t I, name_t T1, name_t T2, name_t O)
+name_t melbshuffle::resume(name_t input)
 {
-    distribution_phase_1(I, T1);
-    distribution_phase_2(T1, T2);
-    cleanup_phase(T2, O);
+    checkpoint *cp = (checkpoints != nullptr) ? checkpoints->load(MELBSHUFFLE_CHECKPOINT, size) : nullptr;
+    if(cp == nullptr) {
+        return permute(input);
+    }
+    pi->set_seed(cp->read<unsigned>());
+    input = cp->read<name_t>();
+    start_pass = cp->read<uint32_t>();
+    start_phase = cp->read<uint32_t>();
+    overflow = cp->read<bool>();
+    delete cp;
+
+    // the input of the interrupted pass is stored at the server
+    cloud->open_array(input + start_pass, size);
+    resuming = true;
+    return permute(input);
 }
 
-void melbshuffle::distribution_phase_1(name_t I, name_t T)
+void melbshuffle::save_checkpoint(uint32_t pass, uint32_t phase)
 {
-    // a bin refers to the elements of an input bucket that belong to the same output chunk
-
-    // array to store buckets from the input
-    element **bucket;
-    uint32_t cid, idx = 0;
-    // maximum load of a bin
-    uint32_t max_load = p1*num_chunks;
-
-    // initialise empty bins (one for each output chunk)
-    std::map<uint32_t, std::vector<element*>*> rev_bin;
-    for (int id = 0; id < num_chunks; ++id) {
-        rev_bin[id] = new std::vector<element*>();
-    }
+    checkpoint cp;
+    cp.write(pi->get_seed());
+    cp.write(input);
+    cp.write(pass);
+    cp.write(phase);
+    cp.write((bool) overflow);
+    write_checkpoint(cp, MELBSHUFFLE_CHECKPOINT, size);
+}
 
-    // iterate through the input buckets, placing elements in the correct output chunks
-    for (int id = 0; id < num_buckets; ++id) {
-        // determine the length of the input bucket. Only the last bucket can have a different length
-        uint32_t range = ((idx + bucket_width) < size) ? bucket_width : (size - idx);
-        // retrieve the bucket
-        bucket = get_range(I, idx, range);
-        element *e;
-        // place elements that belong to the same output chunk in the same bin
-        for (int i = 0; i < range; ++i) {
-            e = bucket[i];
-            cid = pi->eval_perm(e->key)/chunk_width; // chunk id
-            rev_bin[cid]->push_back(e);
+void melbshuffle::shuffle_pass(name_t I, name_t T, name_t O, uint32_t pass)
+{
+    uint32_t repeated = 0;
+    while (true) {
+        // phases that completed before the checkpoint are skipped
+        for (uint32_t l = start_phase; l < c; ++l) {
+            distribution_phase(l, (l == 0) ? I : T + l - 1, T + l);
+            if(checkpoint_due()) {
+                save_checkpoint(pass, l + 1);
+            }
         }
-
-        // push bins to the temporary storage
-        std::vector<element*> *vec;
-        // calculate the offset for each bin. Each output chunk contains a bin from each input bucket
-        uint32_t offset = id*max_load, block_size = num_buckets*max_load;
-        for (int i = 0; i < num_chunks; ++i) {
-            vec = rev_bin[i];
-            assert(vec->size() < max_load);
-            put_bin(T, offset, vec, max_load);
-            offset += block_size;
+        if(!overflow) {
+            break;
         }
-        for (int id = 0; id < num_chunks; ++id) {
-            rev_bin[id]->clear();
+        if(repeated == MELBSHUFFLE_MAX_RETRIES) {
+            // with load parameters below the bound of load_parameter, the pass could overflow indefinitely
+            std::vector<melb_phase> required;
+            layout(size, c, 0, &required);
+            uint32_t p = 0, min_p = 0;
+            for (uint32_t l = 0; l < c; ++l) {
+                p = std::max(p, phases[l].p);
+                min_p = std::max(min_p, required[l].p);
+            }
+            fprintf(stderr, "melbshuffle overflow: %u runs of pass %u overflowed with p = %u (p = %u is required)\n",
+                    repeated + 1, pass, p, min_p);
+            exit(1);
+        }
+        repeated++;
+        // repeat the pass from its input with a new permutation (the temporary arrays are overwritten)
+        overflow = false;
+        start_phase = 0;
+        retries++;
+        pi->new_seed();
+        if(checkpoints != nullptr) {
+            // the last checkpoint holds the previous permutation, which the temporary arrays no longer follow
+            save_checkpoint(pass, 0);
         }
-        idx += bucket_width;
-        free(bucket);
     }
+    cleanup_phase(T + c - 1, O);
 }
 
-void melbshuffle::distribution_phase_2(name_t T1, name_t T2)
+void melbshuffle::distribution_phase(uint32_t l, name_t I, name_t T)
 {
-    element **bucket;
-    uint32_t bid;
-    // max load of an input bin and max load of an output bucket
-    uint32_t max_load1 = p1*num_chunks, max_load2 = p2*num_chunks;
-
-    std::map<uint32_t, std::vector<element*>*> rev_bin;
-    for (int id = 0; id < buckets_per_chunk; ++id) {
-        rev_bin[id] = new std::vector<element*>();
-    }
-
-    // number of elements (both real and dummy) in a chunk
-    uint32_t chunk_card = num_buckets*max_load1;
-    // number of input bins retrieved on each iteration
-    uint32_t num_bins = ceil((double)num_buckets/(double)buckets_per_chunk);
-
-    // iterate through the chunks
-    for (int cid = 0; cid < num_chunks; ++cid) {
-        // offset for the next bin
-        uint32_t offset_bins = 0, range;
-        for (int j = 0; j < buckets_per_chunk; ++j) {
-
-            range = (offset_bins + num_bins < num_buckets) ? num_bins : (num_buckets - offset_bins);
-            range *= max_load1;
-            // retrieve bucket (segment of bins)
-            bucket = get_range(T1, cid*chunk_card + offset_bins*max_load1, range);
-
-            element *e;
-            // place elements in the correct bucket in the chunk
-            for (int elem = 0; elem < range; ++elem) {
-                e = bucket[elem];
-                if(e->key != INT32_MAX) {
-                    bid = (pi->eval_perm(e->key) / bucket_width);
-                    bid %= buckets_per_chunk; // chunk id
-                    rev_bin[bid]->push_back(e);
-                } else {
-                    // delete dummies
-                    delete e;
-                }
+    melb_phase const& phase = phases[l];
+    // a group of the input holds a bin of each segment of the previous phase
+    uint32_t in_bins = (l > 0) ? phases[l-1].segments : 0;
+    uint32_t in_load = (l > 0) ? phases[l-1].max_load : 0;
+    // a subgroup holds a bin of each segment
+    uint32_t region = phase.segments*phase.max_load;
+
+    // iterate through the segments of every group, placing elements in the correct subgroups
+    parallel_for(pool, 0, phase.groups*phase.segments, [&](uint64_t lo, uint64_t hi) {
+        melb_buffers buf(max_retrieved, max_placed, max_bins);
+        uint32_t g, j, first, range, key;
+        for (uint32_t s = lo; s < hi; ++s) {
+            g = s / phase.segments;
+            j = s % phase.segments;
+            if(l == 0) {
+                // the segments of the first phase are the input buckets. Only the last bucket can have a
+                // different length
+                first = j*bucket_width;
+                range = std::min(bucket_width, size - first);
+                cloud->get_records(I, first, range, buf.records.data());
+            } else {
+                // a segment is a run of bins of the group (the last segments can be shorter or empty)
+                first = j*phase.bins_per_segment;
+                range = (first < in_bins) ? std::min(phase.bins_per_segment, in_bins - first)*in_load : 0;
+                cloud->get_records(I, (g*in_bins + first)*in_load, range, buf.records.data());
             }
 
-            // push bins into the temporary array
-            std::vector<element*> *vec;
-            uint32_t offset = cid*max_load2*buckets_per_chunk*buckets_per_chunk + j*max_load2;
-            for (bid = 0; bid < buckets_per_chunk; bid++) {
-                vec = rev_bin[bid];
-                assert(vec->size() < max_load2);
-                put_bin(T2, offset, vec, max_load2);
-                offset += max_load2*buckets_per_chunk;
+            // the bin of an element is its subgroup (dummies are dropped)
+            for (uint32_t i = 0; i < range; ++i) {
+                key = server::record_key(&buf.records[(size_t) i*BYTESPERELEM]);
+                buf.bin_ids[i] = (key != DUMMY_KEY) ? (pi->eval_perm(key) / bucket_width / phase.span) % phase.radix
+                                                    : phase.radix;
             }
-            for (int id = 0; id < buckets_per_chunk; ++id) {
-                rev_bin[id]->clear();
-            }
-            free(bucket);
-            offset_bins += num_bins;
-        }
+            fill_bins(&buf, range, phase.radix, phase.max_load);
 
-    }
+            // bin d is bin j of subgroup g*radix + d
+            put_bins(&buf, T, g*phase.radix*region + j*phase.max_load, region, phase.radix, phase.max_load);
+        }
+    });
 }
 
 void melbshuffle::cleanup_phase(name_t T, name_t O)
 {
-    element **block;
-    auto *catchment = new std::vector<element*>();
-    uint32_t max_load = p2*num_chunks;
-    uint32_t offset = 0, t2_bucket_size = buckets_per_chunk*max_load;
+    // an output bucket holds a bin of each segment of the last phase
+    uint32_t bucket_records = phases[c-1].segments*phases[c-1].max_load;
 
     // iterate through the buckets
-    for (int id = 0; id < num_buckets; ++id) {
-        // retrieve the next bucket
-        block = get_range(T, id*t2_bucket_size, t2_bucket_size);
-
-        element *e;
-        for (int i = 0; i < t2_bucket_size; ++i) {
-            e = block[i];
-            if(e->key != INT32_MAX)
-            {
-                // we will utilize the auxiliary storage for sorting
-                e->aux = pi->eval_perm(e->key);
-                catchment->push_back(e);
-            } else {
+    parallel_for(pool, 0, num_buckets, [&](uint64_t lo, uint64_t hi) {
+        melb_buffers buf(max_retrieved, max_placed, max_bins);
+        uint32_t key, slot, range, offset;
+        char *record;
+        for (uint32_t id = lo; id < hi; ++id) {
+            // retrieve the next bucket
+            cloud->get_records(T, id*bucket_records, bucket_records, buf.records.data());
+
+            // the destinations of the real elements of bucket id are the range of the bucket in the
+            // output, so each element is placed directly at its slot (no sort is needed)
+            offset = id*bucket_width;
+            range = (offset + bucket_width < size) ? bucket_width : (size - offset);
+            for (uint32_t i = 0; i < bucket_records; ++i) {
+                key = server::record_key(&buf.records[(size_t) i*BYTESPERELEM]);
                 // remove the dummies
-                delete e;
+                if(key != DUMMY_KEY) {
+                    slot = pi->eval_perm(key) - offset;
+                    if(slot >= range) {
+                        // the temporary arrays were not distributed by pi
+                        fprintf(stderr, "melbshuffle: element %u is not in output bucket %u\n", key, id);
+                        exit(1);
+                    }
+                    record = &buf.bins[(size_t) slot*BYTESPERELEM];
+                    memcpy(record, &buf.records[(size_t) i*BYTESPERELEM], BYTESPERELEM);
+                    // the auxiliary information of the output is cleared
+                    memset(record + sizeof(uint32_t), 0, sizeof(tag_t));
+                }
             }
+            // place the bucket in the output array
+            cloud->put_records(O, offset, range, buf.bins.data());
         }
-        // sort the bucket according to the permutation values
-        std::sort(catchment->begin(), catchment->end(), compare);
-        // place the bucket in the output array
-        put_bucket(O, offset, catchment);
+    });
+}
 
-        offset += bucket_width;
-        catchment->clear();
-        free(block);
+void melbshuffle::fill_bins(melb_buffers *buf, uint32_t count, uint32_t num_bins, uint32_t max_load)
+{
+    char *bins = buf->bins.data();
+    uint32_t *loads = buf->loads.data();
+    // empty bins are dummies
+    memset(bins, DUMMY_BYTE, (size_t) num_bins*max_load*BYTESPERELEM);
+    memset(loads, 0, num_bins*sizeof(uint32_t));
+    uint32_t bin;
+    for (uint32_t i = 0; i < count; ++i) {
+        bin = buf->bin_ids[i];
+        if(bin >= num_bins) {
+            continue;
+        }
+        if(loads[bin] < max_load) {
+            memcpy(bins + ((size_t) bin*max_load + loads[bin]++)*BYTESPERELEM,
+                   &buf->records[(size_t) i*BYTESPERELEM], BYTESPERELEM);
+        } else {
+            // the pass is repeated, so the extra records are discarded
+            overflow = true;
+        }
     }
 }
 
-void melbshuffle::put_bin(name_t T, uint32_t idx, std::vector<element*> *bin, uint32_t max_load)
+uint32_t melbshuffle::load_parameter(double bins, double mean, uint32_t scale, double failure)
 {
-    uint32_t count = 0;
-    uint32_t bin_load = bin->size();
-    assert(bin_load < max_load);
-    // place bin elements in temporary storage
-    while(count < bin_load)
-    {
-        cloud->put(T, idx+count, bin->at(count));
-        count++;
-    }
-    // pad bin to max load with dummies
-    for (int i = count; i < max_load; ++i) {
-        cloud->put(T, idx+i, new element(INT32_MAX, 0, nullptr));
+    double a;
+    // the failure bound decreases with the parameter, so the smallest parameter is found by a linear search
+    for (uint32_t p = 1; ; ++p) {
+        // a bin overflows if it receives a = p*scale + 1 elements
+        a = p * (double) scale + 1;
+        if(a > mean && log(bins) - mean + a * (1 + log(mean) - log(a)) <= log(failure)) {
+            return p;
+        }
     }
 }
 
-void melbshuffle::put_bucket(name_t O, uint32_t offset, std::vector<element*> *bucket)
+void melbshuffle::put_bins(melb_buffers *buf, name_t T, uint32_t offset, uint32_t stride, uint32_t num_bins,
+                           uint32_t max_load)
 {
-    // calculate the range of the bucket
-    uint32_t range = (offset + bucket_width < size) ? bucket_width : (size - offset);
-    element *e;
-    for (int i = 0; i < range; ++i)
-    {
-        e = bucket->at(i);
-        e->aux = 0;
-        cloud->put(O, offset + i, e);
+    for (uint32_t bin = 0; bin < num_bins; ++bin) {
+        cloud->put_records(T, offset + bin*stride, max_load, &buf->bins[(size_t) bin*max_load*BYTESPERELEM]);
     }
 }
 
-element **melbshuffle::get_range(name_t name, int offset, uint32_t range)
+uint32_t melbshuffle::layout(uint32_t n, uint32_t c, uint32_t p, std::vector<melb_phase> *phases)
 {
-    // allocate an array to store the elements
-    auto bucket = (element**) calloc(range, sizeof(element*));
+    // the smallest integer whose c-th power is at least x
+    auto root = [](uint32_t x, uint32_t c) {
+        auto r = (uint32_t) floor(pow(x, 1.0 / c));
+        while (pow(r, c) < x) {
+            r++;
+        }
+        return std::max(r, 1u);
+    };
+    // output buckets of about n^{1/c} elements
+    uint32_t width = root(n, c);
+    uint32_t buckets = (n + width - 1) / width;
+
+    // the groups of phase l cover buckets/groups output buckets, which are split between radix^{c-l}
+    // groups of the last phase
+    phases->assign(c, melb_phase{});
+    uint32_t groups = 1, remaining;
+    for (uint32_t l = 0; l < c; ++l) {
+        melb_phase &phase = phases->at(l);
+        remaining = (buckets + groups - 1) / groups;
+        phase.groups = groups;
+        // each segment holds about width real elements
+        phase.segments = remaining;
+        phase.bins_per_segment = (l > 0) ? (phases->at(l-1).segments + remaining - 1) / remaining : 1;
+        phase.radix = root(remaining, c - l);
+        groups *= phase.radix;
+    }
+    uint32_t span = 1;
+    for (uint32_t l = c; l-- > 0;) {
+        phases->at(l).span = span;
+        span *= phases->at(l).radix;
+    }
 
-    //retrieve the elements
-    for (int i = 0; i < range; ++i) {
-        bucket[i] = cloud->get(name, offset + i);
+    // the failure probability is split between the phases of the two passes
+    double inputs = 1, mean;
+    for (uint32_t l = 0; l < c; ++l) {
+        melb_phase &phase = phases->at(l);
+        // a segment holds the elements of a set of input buckets, and a bin holds those whose
+        // destinations are in the span of its subgroup
+        inputs *= phase.bins_per_segment;
+        mean = inputs * width * std::min(1.0, (double) phase.span * width / n);
+        auto scale = (uint32_t) std::max(ceil(mean), 1.0);
+        phase.p = (p != 0) ? p : load_parameter((double) phase.groups * phase.segments * phase.radix, mean, scale,
+                MELBSHUFFLE_FAILURE / (2*c));
+        phase.max_load = phase.p*scale;
     }
-    return bucket;
+    return width;
 }
 
+void melbshuffle::buffer_sizes(uint32_t n, uint32_t bucket_width, std::vector<melb_phase> const& phases,
+                               uint32_t *max_retrieved, uint32_t *max_placed, uint32_t *max_bins)
+{
+    uint32_t c = phases.size();
+    // the first phase retrieves input buckets, and the cleanup phase retrieves and places output buckets
+    *max_retrieved = std::max(std::min(bucket_width, n), phases[c-1].segments*phases[c-1].max_load);
+    *max_placed = bucket_width;
+    *max_bins = 1;
+    for (uint32_t l = 0; l < c; ++l) {
+        if(l > 0) {
+            *max_retrieved = std::max(*max_retrieved, phases[l].bins_per_segment*phases[l-1].max_load);
+        }
+        *max_placed = std::max(*max_placed, phases[l].radix*phases[l].max_load);
+        *max_bins = std::max(*max_bins, phases[l].radix);
+    }
+}
 
-
-
-
-
-
-
-
-
-
+uint32_t melbshuffle::num_phases(uint32_t n, uint64_t memory)
+{
+    std::vector<melb_phase> phases;
+    uint32_t width, max_retrieved, max_placed, max_bins;
+    uint64_t bytes;
+    // more phases reduce the memory until the output buckets have two elements
+    for (uint32_t c = 2; ; ++c) {
+        width = layout(n, c, 0, &phases);
+        buffer_sizes(n, width, phases, &max_retrieved, &max_placed, &max_bins);
+        bytes = (uint64_t) (max_retrieved + max_placed)*BYTESPERELEM + (uint64_t) (max_retrieved + max_bins)*sizeof(uint32_t);
+        if(bytes <= memory || width <= 2) {
+            return c;
+        }
+    }
+}
@@ -0,0 +1,124 @@
+/********************************************************************
+ Implementation of Batcher's odd-even merge sort
+
+ Batcher, K.E., 1968, April.
+ Sorting networks and their applications.
+
+ The network sorts arrays of any length: it is the network for the
+ next power of two, in which every comparator is ascending, truncated
+ to the real elements.
+
+ MIT License
+ Copyright (c) 2021 William Holland
+ *********************************************************************/
+
+#include "../headers/oddeven.h"
+
+name_t oddeven::permute(name_t arr)
+{
+    // the first pass hashes the keys into the tags and the last merge clears the tags
+    return network(arr, true);
+}
+
+name_t oddeven::sort(name_t arr)
+{
+    return network(arr, false);
+}
+
+name_t oddeven::network(name_t arr, bool hash)
+{
+    // merges of at most one chunk are applied in client memory
+    sort_chunks(arr, hash, hash && chunk == padded);
+    for (uint32_t p = chunk; p < padded; p*=2) {
+        for (uint32_t k = p; k > 0; k/=2) {
+            strided_stage(arr, p, k, hash && 2*p == padded);
+        }
+    }
+    return arr;
+}
+
+void oddeven::strided_stage(name_t arr, uint32_t p, uint32_t k, bool clear)
+{
+    // a is the lower element of a comparator of the stage with stride s if it is in the first half
+    // of a run and the comparators of the run belong to a merge
+    auto lower = [&](uint32_t a, uint32_t s) {
+        uint32_t first = s % p;
+        return a >= first && (a - first) % (2*s) < s && a + s < size && a / (2*p) == (a + s) / (2*p);
+    };
+    // every position is compared by some stage of the last merge, so a tag is cleared by the last
+    // stage that compares its position
+    auto last = [&](uint32_t a) {
+        for (uint32_t s = k/2; s > 0; s/=2) {
+            if(lower(a, s) || (a >= s && lower(a - s, s))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    // pairs are independent, so each worker applies the pairs of a range of lower indices
+    parallel_for(pool, 0, size, [&](uint64_t lo, uint64_t hi) {
+        element *ea, *eb;
+        for (uint32_t a = lo; a < hi; ++a) {
+            if(!lower(a, k)) {
+                continue;
+            }
+            ea = cloud->get(arr, a);
+            eb = cloud->get(arr, a + k);
+            // route according to the order of the tags
+            if((uint32_t) ea->aux > (uint32_t) eb->aux) {
+                std::swap(ea, eb);
+            }
+            if(clear) {
+                if(last(a)) {
+                    ea->aux = 0;
+                }
+                if(last(a + k)) {
+                    eb->aux = 0;
+                }
+            }
+            cloud->put(arr, a, ea);
+            cloud->put(arr, a + k, eb);
+        }
+    });
+}
+
+void oddeven::sort_chunks(name_t arr, bool hash, bool clear)
+{
+    uint32_t num_chunks = (size + chunk - 1) / chunk;
+    parallel_for(pool, 0, num_chunks, [&](uint64_t lo, uint64_t hi) {
+        std::vector<element*> block(chunk);
+        std::vector<uint64_t> words(chunk);
+        for (uint64_t c = lo; c < hi; ++c) {
+            sort_chunk(arr, c*chunk, hash, clear, block.data(), words.data());
+        }
+    });
+}
+
+void oddeven::sort_chunk(name_t arr, uint32_t offset, bool hash, bool clear, element **block, uint64_t *words)
+{
+    // retrieve the chunk and pack the tag of each element with its position in the chunk
+    uint32_t count = std::min(chunk, size - offset);
+    for (uint32_t k = 0; k < count; ++k) {
+        block[k] = cloud->get(arr, offset + k);
+        if(hash) {
+            block[k]->aux = pi->eval_perm(block[k]->key);
+        }
+        words[k] = pack_tag((uint32_t) block[k]->aux, k);
+    }
+    std::fill(words + count, words + chunk, VIRTUAL_WORD);
+
+    for (uint32_t p = 1; p < chunk; p*=2) {
+        for (uint32_t k = p; k > 0; k/=2) {
+            oddeven_stage(words, chunk, p, k);
+        }
+    }
+    // place the chunk at the server in sorted order
+    element *e;
+    for (uint32_t k = 0; k < count; ++k) {
+        e = block[packed_position(words[k])];
+        if(clear) {
+            e->aux = 0;
+        }
+        cloud->put(arr, offset + k, e);
+    }
+}
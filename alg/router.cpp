@@ -0,0 +1,166 @@
+/********************************************************************
+ Implementation of a routing engine for a configured Waksman network.
+
+ The network is routed level by level. Each node occupies a contiguous
+ range of the arrays, with the inputs of its left subnetwork in the top
+ half of the range and the inputs of its right subnetwork in the bottom
+ half. Leaves are permuted in place, so after the entry and exit levels
+ the columns are back in their input arrays.
+
+ MIT License
+ Copyright (c) 2021 William Holland
+ *********************************************************************/
+
+#include "../headers/router.h"
+
+#define PERSIST true
+
+void router::route(std::vector<name_t> const& columns)
+{
+    inverse = false;
+    route_network(columns);
+}
+
+void router::route_inverse(std::vector<name_t> const& columns)
+{
+    // the reversed network has the same structure with the roles of entry and exit switches exchanged
+    inverse = true;
+    route_network(columns);
+}
+
+void router::route_network(std::vector<name_t> const& columns)
+{
+    // allocate a temporary array for each column
+    std::vector<name_t> input(columns), temp;
+    for (uint32_t c = 0; c < columns.size(); ++c) {
+        temp.push_back(ROUTE_TEMP + c);
+        cloud->create_array(temp[c], length);
+    }
+    std::vector<name_t> *source = &input, *dest = &temp;
+
+    // route through the entry switches from the root to the leaves
+    for (uint32_t level = 0; level < num_levels; ++level) {
+        cursor = 0;
+        route_level(0, length, 0, level, ENTRY, source, dest);
+        std::swap(source, dest);
+    }
+
+    cursor = 0;
+    route_level(0, length, 0, num_levels, LEAF, source, source);
+
+    // route through the exit switches from the leaves to the root
+    for (uint32_t level = num_levels; level > 0; --level) {
+        cursor = 0;
+        route_level(0, length, 0, level-1, EXIT, source, dest);
+        std::swap(source, dest);
+    }
+
+    for (name_t name : temp) {
+        cloud->delete_array(name);
+    }
+}
+
+void router::route_level(uint32_t offset, uint32_t size, uint32_t depth, uint32_t level, route_stage stage,
+        std::vector<name_t> *source, std::vector<name_t> *dest)
+{
+    if(depth == level) {
+        switch (stage) {
+            case ENTRY :
+                route_entry(offset, size, level, source, dest);
+                break;
+            case LEAF :
+                assert(size <= leaf_size);
+                route_leaf(offset, size, source);
+                break;
+            case EXIT :
+                route_exit(offset, size, level, source, dest);
+                break;
+        }
+    } else {
+        // continue the traversal into the left and right subnetworks
+        route_level(offset, size/2, depth+1, level, stage, source, dest);
+        route_level(offset + size/2, size - size/2, depth+1, level, stage, source, dest);
+    }
+}
+
+void router::route_entry(uint32_t offset, uint32_t size, uint32_t level, std::vector<name_t> *source,
+        std::vector<name_t> *dest)
+{
+    uint32_t half = size/2;
+    element *top, *bottom;
+    for (uint32_t i = 0; i < half; ++i) {
+        bool setting = inverse ? config->exit_at(level, cursor + i) : config->entry_at(level, cursor + i);
+        // apply the same switch to every column
+        for (uint32_t c = 0; c < source->size(); ++c) {
+            top = cloud->get(source->at(c), offset + 2*i);
+            bottom = cloud->get(source->at(c), offset + 2*i + 1);
+            if(setting == PERSIST) {
+                cloud->put(dest->at(c), offset + i, top);
+                cloud->put(dest->at(c), offset + half + i, bottom);
+            } else {
+                cloud->put(dest->at(c), offset + i, bottom);
+                cloud->put(dest->at(c), offset + half + i, top);
+            }
+        }
+    }
+    if(size & 1u) {
+        // the bottom wire of an odd node enters the right subnetwork
+        for (uint32_t c = 0; c < source->size(); ++c) {
+            cloud->put(dest->at(c), offset + size - 1, cloud->get(source->at(c), offset + size - 1));
+        }
+    }
+    cursor += half;
+}
+
+void router::route_exit(uint32_t offset, uint32_t size, uint32_t level, std::vector<name_t> *source,
+        std::vector<name_t> *dest)
+{
+    uint32_t half = size/2;
+    element *left, *right;
+    for (uint32_t i = 0; i < half; ++i) {
+        bool setting = inverse ? config->entry_at(level, cursor + i) : config->exit_at(level, cursor + i);
+        // exit switch i receives output i of the left and right subnetworks
+        for (uint32_t c = 0; c < source->size(); ++c) {
+            left = cloud->get(source->at(c), offset + i);
+            right = cloud->get(source->at(c), offset + half + i);
+            if(setting == PERSIST) {
+                cloud->put(dest->at(c), offset + 2*i, left);
+                cloud->put(dest->at(c), offset + 2*i + 1, right);
+            } else {
+                cloud->put(dest->at(c), offset + 2*i, right);
+                cloud->put(dest->at(c), offset + 2*i + 1, left);
+            }
+        }
+    }
+    if(size & 1u) {
+        // the bottom output of the right subnetwork of an odd node is a wire
+        for (uint32_t c = 0; c < source->size(); ++c) {
+            cloud->put(dest->at(c), offset + size - 1, cloud->get(source->at(c), offset + size - 1));
+        }
+    }
+    cursor += half;
+}
+
+void router::route_leaf(uint32_t offset, uint32_t size, std::vector<name_t> *source)
+{
+    element *block[4];
+    uint32_t value[4];
+    for (uint32_t i = 0; i < size; ++i) {
+        if(inverse) {
+            value[config->leaf_at(cursor + i)] = i;
+        } else {
+            value[i] = config->leaf_at(cursor + i);
+        }
+    }
+    for (uint32_t c = 0; c < source->size(); ++c) {
+        // retrieve the leaf and permute in client memory
+        for (uint32_t i = 0; i < size; ++i) {
+            block[value[i]] = cloud->get(source->at(c), offset + i);
+        }
+        // place elements in output order
+        for (uint32_t i = 0; i < size; ++i) {
+            cloud->put(source->at(c), offset + i, block[i]);
+        }
+    }
+    cursor += size;
+}
@@ -12,117 +12,547 @@
  *********************************************************************/
 
 #include <tgmath.h>
+#include <algorithm>
 #include "../headers/waksman.h"
+#include "../headers/router.h"
 
 
 
 name_t waksman::permute(name_t name)
 {
-    // allocate temporary storage
+    // allocate temporary storage. Both phases alternate between the input array and a temporary array
     temp1 = name;
     temp2 = name+1;
-    cloud->create_array(temp2, length);
-    temp3 = name+2;
-    cloud->create_array(temp3, length);
-    skip_array = name+3;
-    cloud->create_array(skip_array, length);
+    prepare_array(temp2, length);
+    temp3 = name+3;
+    if(checkpoints != nullptr) {
+        prepare_array(temp3, length);
+    }
+    if(resuming) {
+        // the wires of the last routed node may not have been placed before the crash
+        place_wires();
+    }
 
-    // determine the size of a leaf
-    uint32_t msb = 32 - clz(length | 1u);
-    uint32_t mask = 1u << (msb-1);
-    mask |= (1u << (msb-2));
-    if(length > mask) {
-        leaf_size = 4;
-    } else {
-        leaf_size = 3;
+    set_leaf_size();
+    if(!resuming) {
+        resume_stage = CONFIGURATION_STAGE;
+        resume_progress = 0;
+        if(retain) {
+            delete config;
+            config = new network_config(length, leaf_size);
+        }
     }
+    visited = 0;
 
     // determine the number of levels in the network
     uint32_t num_levels = 2*(sizeof(uint32_t) * CHAR_BIT - clz(length/2) - 1);
-    skip_indices = (uint32_t*) calloc(num_levels/2, sizeof(uint32_t));
+    // the exit switch settings of an element are carried in its tag (one bit per level)
+    assert(num_levels/2 <= TAG_BITS);
 
     // create root node of the permutation tree
     auto *root = new perm_node(nullptr, 1, true, 0, length);
 
-    configuration_phase(root, temp1);
-
-    delete skip_indices;
+    name_t output;
+    if(length >= 4 && !(length & (length - 1))) {
+        // every subnetwork is even and no element skips a level
+        height = __builtin_ctz(length) - 1;
+        // the parents of the blocks are the lowest nodes routed at the server
+        set_split_depth((length > PERMUTE_BLOCK) ? __builtin_ctz(length) - __builtin_ctz(PERMUTE_BLOCK) : 0);
+        if(resume_stage == CONFIGURATION_STAGE) {
+            configuration_phase<true>(root);
+        } else {
+            delete root;
+        }
+        output = empty_road_phase<true>();
+    } else {
+        // the skip array only stores the elements on wires that skip levels
+        skip_array = name+2;
+        uint32_t skip_length = set_skip_segments();
+        prepare_array(skip_array, skip_length);
+        set_split_depth(height);
+
+        if(resume_stage == CONFIGURATION_STAGE) {
+            if(resuming) {
+                // restore the number of skip elements placed before the checkpoint
+                std::copy(resume_skips.begin(), resume_skips.end(), skip_indices);
+            }
+            configuration_phase<false>(root);
+        } else {
+            delete root;
+        }
+        free(skip_indices);
+        skip_indices = nullptr;
 
-    name_t output = empty_road_phase();
+        output = empty_road_phase<false>();
+        free(skip_base);
+        cloud->delete_array(skip_array);
+    }
 
     // delete unused arrays
-    cloud->delete_array(skip_array);
-    cloud->delete_array(temp2);
-    if(output == temp1) {
-        cloud->delete_array(temp3);
-    } else {
-        cloud->delete_array(temp1);
+    for (name_t temp : {temp1, temp2, temp3}) {
+        if(temp != output && (temp != temp3 || checkpoints != nullptr)) {
+            cloud->delete_array(temp);
+        }
+    }
+
+    resuming = false;
+    if(checkpoints != nullptr) {
+        checkpoints->clear();
     }
+    return output;
+}
 
+name_t waksman::resume(name_t name)
+{
+    checkpoint *cp = (checkpoints != nullptr) ? checkpoints->load(WAKSMAN_CHECKPOINT, length) : nullptr;
+    if(cp == nullptr) {
+        return permute(name);
+    }
+    pi->set_seed(cp->read<unsigned>());
+    name = cp->read<name_t>();
+    // the input array is also the first temporary array
+    cloud->open_array(name, length);
+    resume_stage = cp->read<uint32_t>();
+    resume_progress = cp->read<uint64_t>();
+    road_input = cp->read<name_t>();
+
+    // exteriors are recomputed on resume, so they must be configured the same way as before
+    bool parallel = cp->read<uint8_t>();
+    if(parallel && pool == nullptr) {
+        pool = new thread_pool(1);
+    } else if(!parallel && pool != nullptr) {
+        delete pool;
+        pool = nullptr;
+    }
+
+    resume_skips.resize(TAG_BITS);
+    resume_skips.resize(cp->read_array(resume_skips.data()));
+    // the wires of the last routed node, followed by the wires kept for the subtrees that are not complete
+    for (std::vector<pending_wire> *wires : {&pending_wires, &subtree_wires}) {
+        auto num_wires = cp->read<uint32_t>();
+        for (uint32_t i = 0; i < num_wires; ++i) {
+            auto array = cp->read<name_t>();
+            auto index = cp->read<uint32_t>();
+            auto depth = cp->read<uint32_t>();
+            auto key = cp->read<uint32_t>();
+            auto aux = cp->read<tag_t>();
+            wires->push_back({array, index, depth, new element(key, aux, nullptr)});
+        }
+    }
+    for (pending_wire const& wire : subtree_wires) {
+        auto *elem = new element(wire.elem->key, wire.elem->aux, nullptr);
+        pending_wires.push_back({wire.array, wire.index, wire.depth, elem});
+    }
+    delete cp;
+
+    resuming = true;
+    // the switches of the nodes routed before the crash are not in the checkpoint, so a retained
+    // configuration is computed once the permutation completes
+    bool keep = retain;
+    retain = false;
+    name_t output = permute(name);
+    if(keep) {
+        retain = true;
+        configure();
+    }
     return output;
 }
 
-void waksman::configuration_phase(perm_node *node, name_t source_array)
+void waksman::save_checkpoint(uint32_t stage, uint64_t progress)
+{
+    checkpoint cp;
+    cp.write(pi->get_seed());
+    cp.write(temp1);
+    cp.write(stage);
+    cp.write(progress);
+    cp.write(road_input);
+    cp.write((uint8_t) (pool != nullptr));
+    // the skip elements placed during the configuration phase (none in power of two networks)
+    cp.write_array(skip_indices, (skip_indices != nullptr) ? height : 0);
+    for (std::vector<pending_wire> *wires : {&pending_wires, &subtree_wires}) {
+        cp.write((uint32_t) wires->size());
+        for (pending_wire const& wire : *wires) {
+            cp.write(wire.array);
+            cp.write(wire.index);
+            cp.write(wire.depth);
+            cp.write(wire.elem->key);
+            cp.write(wire.elem->aux);
+        }
+    }
+    write_checkpoint(cp, WAKSMAN_CHECKPOINT, length);
+}
+
+void waksman::place_wires()
+{
+    for (pending_wire const& wire : pending_wires) {
+        cloud->put(wire.array, wire.index, wire.elem);
+    }
+    pending_wires.clear();
+}
+
+void waksman::set_split_depth(uint32_t lowest)
+{
+    split_depth = 1;
+    while(split_depth < MAX_SPLIT_DEPTH && split_depth + 1 < lowest && (length >> split_depth) >= CHECKPOINT_SUBTREE) {
+        split_depth++;
+    }
+    if(split_depth >= lowest) {
+        // the lowest internal nodes would overwrite the inputs of the subtrees
+        split_depth = lowest + 1;
+    }
+}
+
+name_t waksman::level_array(uint32_t depth)
+{
+    if(checkpoints != nullptr && depth > split_depth && !((depth - split_depth) & 1u)) {
+        return temp3;
+    }
+    return (depth & 1u) ? temp1 : temp2;
+}
+
+void waksman::keep_wires(uint32_t boundary)
+{
+    // the nodes are routed in preorder, so the subtrees before the boundary are complete
+    auto end = std::remove_if(subtree_wires.begin(), subtree_wires.end(), [boundary](pending_wire const& wire) {
+        if(wire.index < boundary) {
+            delete wire.elem;
+            return true;
+        }
+        return false;
+    });
+    subtree_wires.erase(end, subtree_wires.end());
+    for (pending_wire const& wire : pending_wires) {
+        if(wire.depth > split_depth) {
+            auto *elem = new element(wire.elem->key, wire.elem->aux, nullptr);
+            subtree_wires.push_back({wire.array, wire.index, wire.depth, elem});
+        }
+    }
+}
+
+uint64_t waksman::count_nodes(uint32_t size, uint32_t leaf)
+{
+    if(size <= leaf) {
+        return 1;
+    }
+    return 1 + count_nodes(size/2, leaf) + count_nodes(size - size/2, leaf);
+}
+
+name_t waksman::unpermute(name_t name)
+{
+    if(config == nullptr) {
+        configure();
+    }
+    router reverse(cloud, config);
+    reverse.route_inverse({name});
+    return name;
+}
+
+network_config *waksman::configure()
+{
+    set_leaf_size();
+    delete config;
+    config = new network_config(length, leaf_size);
+
+    configure_node(new perm_node(nullptr, 1, true, 0, length));
+    return config;
+}
+
+uint32_t waksman::set_skip_segments()
+{
+    // calculate the tree height
+    height = 0;
+    uint32_t size = length;
+    while(size > leaf_size) {
+        height++;
+        size /= 2;
+    }
+
+    // count the skip elements of each destination level. Skips only depend on the shape of the tree
+    skip_indices = (uint32_t*) calloc(height, sizeof(uint32_t));
+    count_skips(new perm_node(nullptr, 1, true, 0, length));
+
+    // each destination level has a contiguous segment in the skip array
+    skip_base = (uint32_t*) calloc(height, sizeof(uint32_t));
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < height; ++i) {
+        skip_base[i] = total;
+        total += skip_indices[i];
+        skip_indices[i] = 0;
+    }
+    return total;
+}
+
+void waksman::count_skips(perm_node *node)
 {
     uint32_t size = node->size;
-    // determine the output array.
-    // at each level the procedure alternates between temporary arrays
-    name_t target_array = (source_array == temp1) ? (temp2) : (temp1);
+    if(size <= leaf_size) {
+        // the element on the bottom output of a leaf skips if the parent is even or the leaf is a right child
+        if(!(node->parent->size & 1u) || !node->is_left_child) {
+            skip_indices[skip_level(node)]++;
+        }
+    } else {
+        count_skips(new perm_node(node, node->depth+1, true, node->offset, size/2));
+        count_skips(new perm_node(node, node->depth+1, false, node->offset+size/2, size/2 + (size & 1u)));
+    }
+    delete node;
+}
 
+void waksman::set_leaf_size()
+{
+    uint32_t msb = 32 - clz(length | 1u);
+    uint32_t mask = 1u << (msb-1);
+    mask |= (1u << (msb-2));
+    if(length > mask) {
+        leaf_size = 4;
+    } else {
+        leaf_size = 3;
+    }
+}
+
+void waksman::configure_node(perm_node *node)
+{
+    uint32_t size = node->size;
     if (size <= leaf_size) {
+        // record the local permutation of the leaf
+        for (uint32_t i = 0; i < size; ++i) {
+            config->push_leaf(eval_pi(node, i));
+        }
+    } else {
+        set_exterior(node);
+        config->push_node(node->depth-1, node->entry, node->exit, size/2);
+
+        // recurse according to a preorder traversal (nodes of a level are visited from left to right)
+        configure_node(new perm_node(node, node->depth+1, true, node->offset, size/2));
+        configure_node(new perm_node(node, node->depth+1, false, node->offset+size/2, size/2 + (size & 1u)));
+    }
+    delete node;
+}
+
+template<bool pow2>
+void waksman::configuration_phase(perm_node *node)
+{
+    uint32_t size = node->size;
+    // determine the input and output arrays.
+    // at each level the procedure alternates between temporary arrays
+    name_t source_array = level_array(node->depth);
+    name_t target_array = level_array(node->depth + 1);
+    uint32_t leaf = pow2 ? PERMUTE_BLOCK : leaf_size;
+
+    // nodes are counted in preorder. The first resume_progress nodes were routed before the checkpoint
+    bool routed = visited < resume_progress;
+    if(routed) {
+        uint64_t num_nodes = count_nodes(size, leaf);
+        if(visited + num_nodes <= resume_progress) {
+            // the subtree is complete
+            visited += num_nodes;
+            delete node;
+            return;
+        }
+    }
+    visited++;
+
+    if (size <= leaf) {
         // leaf node reached
-        route_leaf(node, source_array);
+        // leaves read inputs that are never overwritten by the phase, so they are not checkpointed
+        route_leaf<pow2>(node, source_array, level_array(node->depth - 1));
     } else {
         // non-leaf node
 
-        // set the exterior switches
+        // set the exterior switches (the subnetworks of a routed node require its exterior)
         set_exterior(node);
-        // route elements in the node
-        route_internal_node_cp(node, source_array, target_array);
+        if(!routed) {
+            if(retain) {
+                config->push_node(node->depth-1, node->entry, node->exit, size/2);
+            }
+            // route elements in the node
+            route_internal_node_cp<pow2>(node, source_array, target_array);
+            if(checkpoints != nullptr && node->depth < split_depth) {
+                // the children of the node overwrite its inputs, so the node cannot be routed again
+                keep_wires(node->offset);
+                save_checkpoint(CONFIGURATION_STAGE, visited);
+            }
+            place_wires();
+        }
 
-        // recurse according to a preorder traversal
-        auto left = new perm_node(node, node->depth+1, true, node->offset, size/2);
-        configuration_phase(left, target_array);
+        if(pow2 && size/2 <= leaf) {
+            // the children are blocks, which are routed together (they are never checkpointed)
+            visited += 2;
+            route_blocks(node, target_array, source_array);
+        } else {
+            // recurse according to a preorder traversal
+            auto left = new perm_node(node, node->depth+1, true, node->offset, size/2);
+            configuration_phase<pow2>(left);
 
-        auto right = new perm_node(node, node->depth+1, false, node->offset+size/2, size/2 + (size & 1u));
-        configuration_phase(right, target_array);
+            auto right = new perm_node(node, node->depth+1, false, node->offset+size/2, size/2 + (size & 1u));
+            configuration_phase<pow2>(right);
+        }
+    }
+    if(node->depth == split_depth && checkpoint_due()) {
+        // the subtrees after the node keep their inputs until they are routed
+        keep_wires(node->offset + size);
+        save_checkpoint(CONFIGURATION_STAGE, visited);
     }
     delete node;
 }
 
+template<bool pow2>
 name_t waksman::empty_road_phase()
+{
+    uint32_t start;
+    if(resume_stage == EMPTY_ROAD_STAGE) {
+        start = resume_progress;
+    } else if(pow2) {
+        // the levels below the blocks were routed in client memory during the configuration phase
+        start = 0;
+        while((length >> start) > PERMUTE_BLOCK) {
+            start++;
+        }
+    } else {
+        start = height;
+    }
+
+    // every subtree of the configuration phase is complete
+    keep_wires(length);
+    if(resume_stage != EMPTY_ROAD_STAGE) {
+        road_input = level_array(start);
+        if(checkpoints != nullptr) {
+            // the first level overwrites the inputs of the subtrees routed after the last checkpoint
+            save_checkpoint(EMPTY_ROAD_STAGE, start);
+        }
+    }
+    // the input of the level of the last checkpoint is kept until the next checkpoint
+    name_t kept = road_input;
+
+    // levels are routed in windows of concurrent levels, one level for each worker of the pool.
+    // Within a window a level overwrites the inputs of the level two below it, so a run with checkpoints
+    // routes one level at a time
+    bool pipeline = pool != nullptr && length >= PARALLEL_THRESHOLD && checkpoints == nullptr;
+    uint32_t window = pipeline ? std::min<uint32_t>(PIPELINE_LEVELS, pool->size()) : 1;
+    uint32_t top = start;
+    while(top > 0) {
+        uint32_t bottom = (top > window) ? (top - window + 1) : 1;
+        if(top == bottom) {
+            // without checkpoints the levels alternate between two arrays
+            name_t dest = (road_input == temp1) ? temp2 : temp1;
+            if(checkpoints != nullptr && dest == kept) {
+                dest = (road_input == temp3) ? temp2 : temp3;
+            }
+            route_level_erp<pow2>(top, road_input, dest);
+            road_input = dest;
+        } else {
+            pipeline_levels<pow2>(top, bottom);
+            road_input = level_array(bottom - 1);
+        }
+        top = bottom - 1;
+        if(top > 0 && checkpoint_due()) {
+            save_checkpoint(EMPTY_ROAD_STAGE, top);
+            kept = road_input;
+        }
+    }
+    // the root is routed to the array of depth 0 (or to any array with checkpoints)
+    return road_input;
+}
+
+template<bool pow2>
+void waksman::pipeline_levels(uint32_t top, uint32_t bottom)
+{
+    // the levels below the window are complete
+    watermark.reset(new std::atomic<uint32_t>[height + 2]);
+    for (uint32_t depth = 0; depth < height + 2; ++depth) {
+        watermark[depth] = (depth > top) ? length : 0;
+    }
+    pipelined = true;
+
+    // one stage for each level, deepest first. A stage only waits for deeper levels, which are
+    // taken by the workers before it
+    pool->parallel_for(0, top - bottom + 1, [this, top](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; ++i) {
+            route_level_erp<pow2>(top - i, level_array(top - i), level_array(top - i - 1));
+        }
+    });
+    pipelined = false;
+}
+
+void waksman::wait_for_level(uint32_t depth, uint32_t end)
+{
+    if(!pipelined || watermark[depth] >= end) {
+        return;
+    }
+    std::unique_lock<std::mutex> guard(level_lock);
+    level_done.wait(guard, [this, depth, end] {return watermark[depth] >= end;});
+}
+
+void waksman::publish_level(uint32_t depth, uint32_t end)
+{
+    if(!pipelined) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(level_lock);
+        watermark[depth] = end;
+    }
+    level_done.notify_all();
+}
+
+template<>
+void waksman::route_level_erp<false>(uint32_t depth, name_t source, name_t dest)
 {
     // initialise the root node for traversal
     auto *root = new perm_node(nullptr, 1, true, 0, length);
 
-    name_t source = temp3, dest = temp1;
-    uint32_t skip_index = length;
+    // get offset for the skip elements of the level (parents of leaves have no skip elements)
+    uint32_t level = height - depth;
+    uint32_t skip_index = (level == 0) ? 0 : skip_base[level-1];
+    // perform a pre-order traversal of the nodes of the level
+    preorder_trav(root, depth, source, dest, skip_index);
+    delete root;
+}
 
-    // calculate the tree height
-    uint32_t tree_height = 0, size = length;
-    while(size > leaf_size) {
-        tree_height++;
-        size /= 2;
-    }
+template<>
+void waksman::route_level_erp<true>(uint32_t depth, name_t source, name_t dest)
+{
+    uint32_t log_length = __builtin_ctz(length);
+    element *v_top, *v_bottom;
 
-    // perform a reverse level-order traversal
-    for (int i = tree_height; i > 0; i--) {
-        // for each height i perform a pre-order traversal of depth i
-        preorder_trav(root, i, source, dest, skip_index);
-        dest = source;
-        // alternate the temporary arrays
-        source = (source == temp1) ? temp3 : temp1;
-        // get offset for the skip elements of the next level
-        skip_index /= 2;
+    uint32_t log_size = log_length - depth + 1;
+    uint32_t num_switches = 1u << (log_size - 1);
+    // the outputs of a node are interleaved with the outputs of its sibling (except at the root)
+    uint32_t shift = (depth == 1) ? 1 : 2;
+
+    // every node of a level has the same size, so the nodes are visited in index order
+    for (uint32_t n = 0; n < (1u << (depth - 1)); ++n) {
+        uint32_t source_index = n << log_size;
+        uint32_t dest_index = ((n >> 1u) << (log_size + 1)) | (n & 1u);
+        // the outputs of the node overwrite the inputs of the level below within the parent
+        wait_for_level(depth + 1, (depth == 1) ? length : ((n >> 1u) + 1) << (log_size + 1));
+        for (uint32_t i = 0; i < num_switches; ++i) {
+            v_top = cloud->get(source, source_index + (i << 1u));
+            v_bottom = cloud->get(source, source_index + (i << 1u) + 1);
+
+            // get the switch setting and remove it from the auxiliary information
+            bool persist = v_top->aux & 1u;
+            v_top->aux >>= 1u;
+            v_bottom->aux >>= 1u;
+
+            uint32_t top_index = dest_index + (i << shift);
+            uint32_t bottom_index = top_index + (1u << (shift - 1));
+            cloud->put(dest, top_index, persist ? v_top : v_bottom);
+            cloud->put(dest, bottom_index, persist ? v_bottom : v_top);
+        }
+        publish_level(depth, (n + 1) << log_size);
     }
-    return source;
 }
 
 void waksman::set_exterior(perm_node *node)
 {
+    if(pool != nullptr && node->size >= PARALLEL_THRESHOLD) {
+        set_exterior_parallel(node);
+        return;
+    }
+
     uint32_t num_switch = ceil(node->size/(double)2);
-    auto switch_set_entry = new bitvector(num_switch, false);
-    auto switch_set_exit = new bitvector(num_switch, false);
+    auto switch_set_entry = new packed_bitvector((num_switch + 63) / 64, 0);
+    auto switch_set_exit = new packed_bitvector((num_switch + 63) / 64, 0);
     // initialise bitvectors for switch settings
     auto entry = new bitvector(num_switch, false);
     auto exit = new bitvector(num_switch, false);
@@ -141,7 +571,7 @@ void waksman::set_exterior(perm_node *node)
         // the bottom input and output wires are already "set"
         exit->at(num_switch-1) = SWAP;
         entry->at(num_switch-1) = SWAP;
-        switch_set_entry->at(num_switch-1) = true;
+        set_bit(switch_set_entry, num_switch-1);
         count++;
     } else {
         // network has even size
@@ -150,7 +580,7 @@ void waksman::set_exterior(perm_node *node)
         exit->at(num_switch-1) = PERSIST;
     }
 
-    switch_set_exit->at(num_switch-1) = true;
+    set_bit(switch_set_exit, num_switch-1);
     count++;
 
     // begin traversal of the bipartite graph
@@ -176,16 +606,90 @@ void waksman::set_exterior(perm_node *node)
     node->exit = exit;
 }
 
-void waksman::set_switch(ext_data *data, uint32_t *res, bitvector *settings, bitvector *is_set)
+void waksman::set_exterior_parallel(perm_node *node)
+{
+    uint32_t size = node->size;
+    uint32_t num_switch = ceil(size/(double)2);
+    // odd nodes are completed with a phantom wire (index size) that is mapped to itself
+    uint32_t num_wires = 2*num_switch;
+
+    // local subpermutation and its inverse
+    std::vector<uint32_t> perm(num_wires), inv(num_wires);
+    pool->parallel_for(0, size, [&](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; ++i) {
+            perm[i] = eval_pi(node, i);
+            inv[i] = eval_inv_pi(node, i);
+        }
+    });
+    if(size & 1u) {
+        perm[size] = size;
+        inv[size] = size;
+    }
+
+    // the successor of a wire: move to its switch sibling, then along the exit switch of the sibling.
+    // A wire and its successor are routed to the same subnetwork
+    std::vector<uint32_t> next(num_wires), label(num_wires);
+    // the wire on the top of each exit switch
+    std::vector<uint32_t> exit_top(num_switch);
+    // the wire that must be routed to the top subnetwork: the phantom wire of an odd node or the
+    // wire on the top of the fixed exit switch of an even node
+    uint32_t fixed = (size & 1u) ? size : inv[size-2];
+    pool->parallel_for(0, num_wires, [&](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; ++i) {
+            next[i] = inv[perm[i ^ 1u] ^ 1u];
+            label[i] = (i == fixed) ? 0 : i+1;
+            if((i & 1u) == 0) {
+                exit_top[i/2] = inv[i];
+            }
+        }
+    });
+    // the subpermutation is no longer needed, so its buffers hold the next round of pointer jumping
+    std::vector<uint32_t> &next_tmp = perm, &label_tmp = inv;
+
+    // pointer jumping: after round r each wire holds the minimum label of 2^r wires of its cycle
+    for (uint32_t span = 1; span < num_wires; span *= 2) {
+        pool->parallel_for(0, num_wires, [&](uint64_t lo, uint64_t hi) {
+            for (uint64_t i = lo; i < hi; ++i) {
+                label_tmp[i] = std::min(label[i], label[next[i]]);
+                next_tmp[i] = next[next[i]];
+            }
+        });
+        std::swap(label, label_tmp);
+        std::swap(next, next_tmp);
+    }
+
+    // the cycle of a wire and the cycle of its switch sibling are routed to different subnetworks.
+    // The cycle with the smaller label is routed to the top subnetwork
+    std::vector<uint8_t> entry_set(num_switch), exit_set(num_switch);
+    pool->parallel_for(0, num_switch, [&](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; ++i) {
+            entry_set[i] = label[2*i] < label[2*i+1];
+            uint32_t top = exit_top[i];
+            exit_set[i] = label[top] < label[top ^ 1u];
+        }
+    });
+
+    // bitvectors share words between switches, so they are written by a single thread
+    auto entry = new bitvector(num_switch, false);
+    auto exit = new bitvector(num_switch, false);
+    for (uint32_t i = 0; i < num_switch; ++i) {
+        entry->at(i) = entry_set[i] ? PERSIST : SWAP;
+        exit->at(i) = exit_set[i] ? PERSIST : SWAP;
+    }
+    node->entry = entry;
+    node->exit = exit;
+}
+
+void waksman::set_switch(ext_data *data, uint32_t *res, bitvector *settings, packed_bitvector *is_set)
 {
     // is the target node set
-    if(!is_set->at(data->tar/2)) {
+    if(!get_bit(is_set, data->tar/2)) {
         // entry node is not set
         // configure entry node to the corresponding exit node
         data->configure();
         settings->at(data->tar/2) = data->cur_setting;
         // node is now set
-        is_set->at(data->tar/2) = true;
+        set_bit(is_set, data->tar/2);
 
         // move to the neighbour index of the current entry node
         data->update_index();
@@ -193,35 +697,99 @@ void waksman::set_switch(ext_data *data, uint32_t *res, bitvector *settings, bit
         // check if the reserve entry node has been set
         if(*res == data->tar/2) {
             // find next unset node as the reserve
-            *res = next_null(is_set, *res);
+            *res = next_null(is_set, *res, settings->size());
         }
     } else {
         // entry node is set; use reserve node
         data->cur = 2*(*res);
         data->cur_setting = PERSIST;
         settings->at(data->cur/2) = data->cur_setting;
-        is_set->at(data->cur/2) = true;
+        set_bit(is_set, data->cur/2);
         // find next reserve
-        *res = next_null(is_set, *res);
+        *res = next_null(is_set, *res, settings->size());
     }
 }
 
-void waksman::route_leaf(perm_node *node, name_t source)
+template<>
+void waksman::route_leaf<false>(perm_node *node, name_t source, name_t dest)
 {
     // the orientation of the leaf (left or right child) determines the offset in the output array
     uint32_t offset = node->parent->offset;
     if(!node->is_left_child) {
         offset++;
     }
+    // leaves hold at most four elements, which are retrieved with one read
+    char records[4*BYTESPERELEM];
+    cloud->get_records(source, node->offset, node->size, records);
     element *e;
+    uint32_t value;
     // route each element in the leaf
-    for (int i = 0; i < node->size; ++i) {
-        e = cloud->get(source, node->offset + i);
-        route_element(node, e, offset, eval_pi(node, i));
+    for (uint32_t i = 0; i < node->size; ++i) {
+        e = cloud->to_element(records + i*BYTESPERELEM);
+        value = eval_pi(node, i);
+        if(retain) {
+            config->push_leaf(value);
+        }
+        route_element(node, e, offset, value, dest);
     }
 }
 
-void waksman::route_element(perm_node *node, element *elem, uint32_t offset, uint32_t value)
+template<>
+void waksman::route_leaf<true>(perm_node *node, name_t source, name_t dest)
+{
+    // the root is a single block
+    route_blocks(node, source, dest);
+}
+
+void waksman::route_blocks(perm_node *node, name_t source, name_t dest)
+{
+    uint32_t size = node->size;
+    char records[2*PERMUTE_BLOCK*BYTESPERELEM], output[2*PERMUTE_BLOCK*BYTESPERELEM];
+    cloud->get_records(source, node->offset, size, records);
+    if(node->parent == nullptr && size <= PERMUTE_BLOCK) {
+        permute_records(node, records, output, 0);
+        if(retain) {
+            configure_node(new perm_node(nullptr, node->depth, true, node->offset, size));
+        }
+    } else {
+        // the outputs of a block are interleaved with the outputs of its sibling
+        auto left = new perm_node(node, node->depth+1, true, node->offset, size/2);
+        auto right = new perm_node(node, node->depth+1, false, node->offset+size/2, size/2);
+        permute_records(left, records, output, 1);
+        permute_records(right, records + (size/2)*BYTESPERELEM, output + BYTESPERELEM, 1);
+        if(retain) {
+            // record the switches of the blocks (configure_node releases its node)
+            configure_node(left);
+            configure_node(right);
+        } else {
+            delete left;
+            delete right;
+        }
+    }
+    cloud->put_records(dest, node->offset, size, output);
+}
+
+void waksman::permute_records(perm_node *block, char const *records, char *output, uint32_t shift)
+{
+    uint32_t size = block->size;
+    uint32_t last = 2*__builtin_ctz(size) - 2;
+    uint32_t dest[PERMUTE_BLOCK];
+    uint64_t keys[PERMUTE_BLOCK], tags[PERMUTE_BLOCK], masks[MAX_PERMUTE_LAYERS] = {};
+    for (uint32_t i = 0; i < size; ++i) {
+        keys[i] = server::record_key(records + i*BYTESPERELEM);
+        tags[i] = server::record_tag(records + i*BYTESPERELEM);
+    }
+    // set the switches of the block for its local subpermutation and apply them to both words of the records
+    eval_pi_block(block, dest);
+    route_benes(dest, size, 0, 0, last, masks);
+    apply_benes(keys, masks, size);
+    apply_benes(tags, masks, size);
+    for (uint32_t j = 0; j < size; ++j) {
+        server::to_record((uint32_t) keys[j], tags[j], output + (j << shift)*BYTESPERELEM);
+    }
+}
+
+void waksman::route_element(perm_node *node, element *elem, uint32_t offset, uint32_t value, name_t dest)
 {
     // does the element skip a level?
     bool skip = false;
@@ -234,68 +802,61 @@ void waksman::route_element(perm_node *node, element *elem, uint32_t offset, uin
     }
     if(skip) {
         // element skips a level
-        skip_fn(node, elem, length / 2, 0);
+        skip_fn(node, elem);
     } else {
         // otherwise element goes to the next level
         offset += value *2;
-        cloud->put(temp3, offset, elem);
+        cloud->put(dest, offset, elem);
     }
 }
 
-void waksman::skip_fn(perm_node *node, element *element, uint32_t offset, uint32_t index)
+void waksman::skip_fn(perm_node *node, element *element)
 {
     // The key objective is to find the destination level
     // All elements of the same destination level are placed together in the skip array
+    uint32_t index = skip_level(node);
+
+    // remove auxiliary information related to the levels skipped
+    element->aux >>= (index+1);
+    cloud->put(skip_array, skip_base[index] + skip_indices[index], element);
+    skip_indices[index]++;
+}
 
+uint32_t waksman::skip_level(perm_node *node)
+{
+    uint32_t index = 0;
     // skip case depends on the parity of the siblings
     perm_node *parent = node->parent;
 
-    if(parent->parent != nullptr) {
+    while(parent->parent != nullptr) {
         // grandparent is a node
 
         // check cardinality of grandparent
         switch(parent->parent->size & 1u) {
             case EVEN :
-                if(parent->size & 1u) {
-                    // this is the OO case (parent and parent's sibling are odd)
-                    // skip to the next level
-                    skip_fn(parent, element, offset/2, index+1);
-                } else {
-                    // this is the EE case
-                    if(node->is_left_child) {
-                        // destination level is reached
-
-                        // remove auxiliary information related to the levels skipped
-                        element->aux >>= (index+1);
-                        cloud->put(skip_array, offset + skip_indices[index], element);
-                        skip_indices[index]++;
-                    } else {
-                        skip_fn(parent, element, offset/2, index+1);
-                    }
+                // in the OO case (parent and parent's sibling are odd) skip to the next level.
+                // In the EE case the destination level is reached if the current node is a left child
+                if(!(parent->size & 1u) && node->is_left_child) {
+                    return index;
                 }
                 break;
             case ODD :
+                // destination level is reached if parent or current node are left children
                 if(parent->is_left_child || node->is_left_child) {
-                    // destination level is reached if parent or current node are left children
-
-                    // remove auxiliary information related to the levels skipped
-                    element->aux >>= (index+1);
-                    cloud->put(skip_array, offset + skip_indices[index], element);
-                    skip_indices[index]++;
-                } else  {
-                    skip_fn(parent, element, offset/2, index+1);
+                    return index;
                 }
                 break;
         }
-    } else {
-        // parent is the root
-        element->aux >>= (index+1);
-        cloud->put(skip_array, offset + skip_indices[index], element);
-        skip_indices[index]++;
+        node = parent;
+        parent = node->parent;
+        index++;
     }
+    // parent is the root
+    return index;
 }
 
-void waksman::route_internal_node_cp(perm_node *node, name_t source, name_t dest)
+template<>
+void waksman::route_internal_node_cp<false>(perm_node *node, name_t source, name_t dest)
 {
     uint32_t num_switches = ceil(node->size/(double)2);
     uint32_t size = node->size;
@@ -317,11 +878,11 @@ void waksman::route_internal_node_cp(perm_node *node, name_t source, name_t dest
                 e1 = get_update_elem(node, source, node->size-2);
                 e2 = get_update_elem(node, source, node->size-1);
                 if(node->entry->at(num_switches-1) == PERSIST) {
-                    route_wire(e1, size/2, eval_pi(node, size-2)/2, node->offset + num_switches - 1, dest);
-                    route_wire(e2, size/2, eval_pi(node, size-1)/2, node->offset + size - 1, dest);
+                    route_wire(e1, size/2, eval_pi(node, size-2)/2, node->offset + num_switches - 1, node->depth + 1);
+                    route_wire(e2, size/2, eval_pi(node, size-1)/2, node->offset + size - 1, node->depth + 1);
                 } else {
-                    route_wire(e2, size/2, eval_pi(node, size-1)/2, node->offset + num_switches - 1, dest);
-                    route_wire(e1, size/2, eval_pi(node, size-2)/2, node->offset + node->size - 1, dest);
+                    route_wire(e2, size/2, eval_pi(node, size-1)/2, node->offset + num_switches - 1, node->depth + 1);
+                    route_wire(e1, size/2, eval_pi(node, size-2)/2, node->offset + node->size - 1, node->depth + 1);
                 }
 
             } else {
@@ -337,11 +898,11 @@ void waksman::route_internal_node_cp(perm_node *node, name_t source, name_t dest
                 e2 = get_update_elem(node, source, node->size-2);
 
                 if(node->entry->at(num_switches-2) == PERSIST) {
-                    route_wire(e1, size/2, eval_pi(node, size-3)/2, node->offset + num_switches - 2, dest);
+                    route_wire(e1, size/2, eval_pi(node, size-3)/2, node->offset + num_switches - 2, node->depth + 1);
                     cloud->put(dest, node->offset + size-2, e2);
                 } else {
                     cloud->put(dest, node->offset +size-2, e1);
-                    route_wire(e2, size/2, eval_pi(node, size-2)/2, node->offset + num_switches - 2, dest);
+                    route_wire(e2, size/2, eval_pi(node, size-2)/2, node->offset + num_switches - 2, node->depth + 1);
                 }
 
             } else {
@@ -354,12 +915,21 @@ void waksman::route_internal_node_cp(perm_node *node, name_t source, name_t dest
             // we have to retrieve the wire if the node is the parent
             if(node->parent == nullptr) {
                 e1 = get_update_elem(node, source, node->size-1);
-                route_wire(e1, ceil(node->size/(double)2), eval_pi(node, size-1)/2, node->offset + node->size - 1, dest);
+                route_wire(e1, ceil(node->size/(double)2), eval_pi(node, size-1)/2, node->offset + node->size - 1, node->depth + 1);
             }
             break;
     }
 }
 
+template<>
+void waksman::route_internal_node_cp<true>(perm_node *node, name_t source, name_t dest)
+{
+    // the node and its children are even, so every switch is routed in the same way
+    for (uint32_t i = 0; i < (node->size >> 1u); ++i) {
+        route_switch_cp(node, source, dest, i);
+    }
+}
+
 void waksman::route_switch_cp(perm_node *node,name_t source, name_t dest, uint32_t index)
 {
     element *u_even, *u_odd;
@@ -380,23 +950,22 @@ void waksman::route_switch_cp(perm_node *node,name_t source, name_t dest, uint32
     }
 }
 
-void waksman::route_wire(element *element, uint32_t size, uint32_t perm_value, uint32_t index, name_t dest) {
+void waksman::route_wire(element *element, uint32_t size, uint32_t perm_value, uint32_t index, uint32_t depth) {
 
     // if node is even or a leaf, place element in the current level
     if( (size & 1u) == 0 || (size == 3)) {
-        cloud->put(dest, index, element);
+        pending_wires.push_back({level_array(depth), index, depth, element});
     } else {
         // skip to the next level
 
         // compute the value of the exit switch that is mapped to the input wire
         bool exit_switch = (perm_value & 1u) ? PERSIST : SWAP;
-        dest = (dest == temp1) ? (temp2) : (temp1);
         // add exit switch to auxiliary information
         element->aux <<= 1u;
-        element->aux |= (uint32_t) (exit_switch & 1u);
+        element->aux |= (tag_t) (exit_switch & 1u);
 
         // recurse
-        route_wire(element, ceil(size/(double)2), perm_value/2, index, dest);
+        route_wire(element, ceil(size/(double)2), perm_value/2, index, depth + 1);
     }
 }
 
@@ -407,17 +976,22 @@ element *waksman::get_update_elem(perm_node *node,name_t source, uint32_t index)
     // add exit settings to auxiliary information
     bool setting = node->exit->at(eval_pi(node, index)/2);
     elem->aux <<= 1u;
-    elem->aux |= (uint32_t) (setting & 1u);
+    elem->aux |= (tag_t) (setting & 1u);
 
     return elem;
 }
 
-uint32_t waksman::preorder_trav(perm_node *node, int depth, name_t source, name_t  dest, uint32_t skip_index)
+uint32_t waksman::preorder_trav(perm_node *node, uint32_t depth, name_t source, name_t  dest, uint32_t skip_index)
 {
     if(node->depth == depth) {
         // We have hit the leaf node.
         // Route the elements through the exit switches of the subnetwork.
-         return route_internal_node_erp(node, source, dest, skip_index);
+        // The outputs of the node overwrite the inputs of the level below within the parent
+        perm_node *parent = node->parent;
+        wait_for_level(depth + 1, (parent == nullptr) ? length : parent->offset + parent->size);
+        skip_index = route_internal_node_erp(node, source, dest, skip_index);
+        publish_level(depth, node->offset + node->size);
+        return skip_index;
     } else {
         // internal node
         uint32_t size = node->size;
@@ -444,13 +1018,13 @@ unsigned int waksman::route_internal_node_erp(perm_node *node, name_t source, na
 
     // if we are at the root node, retrieve required elements from the skip array
     if(node->parent == nullptr) {
-        complete_bottom_wires(dest, skip_index/2);
+        complete_bottom_wires(dest, skip_base[height-1]);
     }
 
     uint32_t source_index = node->offset;
     if(node->size <= leaf_size*2) {
         // parents of leaf nodes contain no skip elements
-        for (int i = 0; i < num_switches-1; ++i) {
+        for (uint32_t i = 0; i < num_switches-1; ++i) {
             route_switch_erp(source, dest, source_index, node, i);
             source_index+=2;
         }
@@ -458,7 +1032,7 @@ unsigned int waksman::route_internal_node_erp(perm_node *node, name_t source, na
         // else, the bottom switches contain elements that skipped from the configuration phase
 
         // route the non-skip elements first
-        for (int i = 0; i < num_switches-3; ++i) {
+        for (uint32_t i = 0; i < num_switches-3; ++i) {
             route_switch_erp(source, dest, source_index, node, i);
             source_index+=2;
         }
@@ -608,6 +1182,27 @@ uint32_t waksman::eval_pi(perm_node *node, uint32_t key)
     }
 }
 
+void waksman::eval_pi_block(perm_node *block, uint32_t *dest)
+{
+    uint32_t size = block->size, levels = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        dest[i] = i;
+    }
+    // follow the inputs to the root (see eval_pi)
+    for (perm_node *node = block; node->parent != nullptr; node = node->parent) {
+        bitvector *entry = node->parent->entry;
+        bool upper = node->is_left_child ? PERSIST : SWAP;
+        for (uint32_t i = 0; i < size; ++i) {
+            dest[i] = 2*dest[i] + (entry->at(dest[i]) != upper);
+        }
+        levels++;
+    }
+    // each level halves the value of the subpermutation
+    for (uint32_t i = 0; i < size; ++i) {
+        dest[i] = pi->eval_perm(dest[i]) >> levels;
+    }
+}
+
 uint32_t waksman::eval_inv_pi(perm_node *node, uint32_t key)
 {
     perm_node *parent = node->parent;
@@ -637,33 +1232,20 @@ uint32_t waksman::eval_inv_pi(perm_node *node, uint32_t key)
     }
 }
 
-uint32_t waksman::next_null(bitvector *bitvec, uint32_t index) {
-    uint32_t length = bitvec->size();
+uint32_t waksman::next_null(packed_bitvector *bitvec, uint32_t index, uint32_t length) {
     if(index == length) {
         return length;
     }
     index++;
 
+    // search a word at a time for an unset bit
     while(index < length) {
-        if(bitvec->at(index)) {
-            index++;
-        } else {
-            return index;
+        uint64_t word = ~bitvec->at(index / 64) >> (index % 64);
+        if(word != 0) {
+            index += __builtin_ctzll(word);
+            return (index < length) ? index : length;
         }
+        index += 64 - (index % 64);
     }
-    return index;
+    return length;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -10,8 +10,11 @@
 #ifndef MY_PROJECT_ORP_H
 #define MY_PROJECT_ORP_H
 
+#include <string>
+#include <chrono>
 #include "../utils/permutation.h"
 #include "../utils/server.h"
+#include "../utils/checkpoint.h"
 
 class ORP
 {
@@ -20,19 +23,95 @@ protected:
     permutation *pi;
     // the server that stores the input array
     server *cloud;
+    // checkpoints of the run (nullptr if checkpoints are disabled)
+    checkpoint_log *checkpoints;
+    // minimum time between the checkpoints of algorithms that can continue from any earlier boundary
+    std::chrono::steady_clock::duration checkpoint_interval;
+    std::chrono::steady_clock::time_point last_checkpoint;
+    // the arrays of the current run are stored at the server by an interrupted run
+    bool resuming;
+
+    /**
+    Checkpoints of algorithms whose boundaries do not overwrite the inputs of earlier boundaries are
+     taken once the interval has passed since the last checkpoint, which keeps their cost small for
+     any number of boundaries.
+    @return true if a checkpoint should be written
+    */
+    bool checkpoint_due()
+    {
+        if(checkpoints == nullptr) {
+            return false;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if(now - last_checkpoint < checkpoint_interval) {
+            return false;
+        }
+        last_checkpoint = now;
+        return true;
+    }
+
+    /**
+    Writes a checkpoint once the server arrays it refers to are on disk.
+    @param cp The state of the run
+    @param type The algorithm that wrote the checkpoint
+    @param length The length of the permuted array
+    */
+    void write_checkpoint(checkpoint const& cp, uint32_t type, uint32_t length)
+    {
+        cloud->sync();
+        checkpoints->save(cp, type, length);
+    }
+
+    /**
+    Creates a temporary array, or opens it if the run is resumed from a checkpoint.
+    @param name The identifier for the array
+    @param length The length of the array
+    */
+    void prepare_array(name_t name, uint32_t length)
+    {
+        if(resuming) {
+            cloud->open_array(name, length);
+        } else {
+            cloud->create_array(name, length);
+        }
+    }
 
 public:
 
     explicit ORP(server *cloud, uint32_t size):
         pi(new permutation(size)),
-        cloud(cloud)
+        cloud(cloud),
+        checkpoints(nullptr),
+        checkpoint_interval(std::chrono::seconds(60)),
+        resuming(false)
     {}
 
     /**
     Permute array according to pi
     @param input_name The identifier for the array
     */
-    virtual name_t permute(name_t input_name) {return 0;}
+    virtual name_t permute(name_t input_name) {(void) input_name; return 0;}
+
+    /**
+    Continues an interrupted permutation from its last checkpoint. The random state of the run
+     (including pi) is restored from the checkpoint. If there is no checkpoint the permutation
+     starts from the beginning.
+    @param input_name The identifier for the input array of the interrupted run
+    */
+    virtual name_t resume(name_t input_name) {return permute(input_name);}
+
+    /**
+    Enables checkpoints. The checkpoints are removed when the permutation completes.
+    @param filename The name of the checkpoint file (next to the server arrays)
+    @param interval The minimum number of seconds between periodic checkpoints
+    */
+    void enable_checkpoints(std::string const& filename, uint32_t interval = 60)
+    {
+        delete checkpoints;
+        checkpoints = new checkpoint_log(filename);
+        checkpoint_interval = std::chrono::seconds(interval);
+        last_checkpoint = std::chrono::steady_clock::now();
+    }
 
     /**
     Return the value of the local permutation function
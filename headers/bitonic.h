@@ -5,21 +5,118 @@
 #ifndef MY_PROJECT_BITONIC_H
 #define MY_PROJECT_BITONIC_H
 
+#include <vector>
+#include <algorithm>
 #include "../utils/server.h"
 #include "../utils/permutation.h"
+#include "../utils/compare_exchange.h"
+#include "../utils/thread_pool.h"
 #include "ORP.h"
 
 class bitonic : public ORP
 {
 private:
     uint32_t size;
+    // the network on size elements is the network on padded elements (a power of two) with virtual
+    // maximal elements at the end. Comparators with a virtual element never swap, so they are skipped
+    uint32_t padded;
+    // number of elements in a chunk of client memory (a power of two)
+    uint32_t chunk;
+    // workers for the stages (nullptr if single threaded)
+    thread_pool *pool;
+
+    /**
+    Sorts the array by the tags of the elements.
+    @param arr The identifier for the array
+    @param hash If true, the tags are the hash values of the keys. They are written to the auxiliary
+     information by the first pass and cleared by the last pass
+    @return the identifier of the output array
+    */
+    name_t network(name_t arr, bool hash);
+
+    /**
+    Applies a stage of the network at the server. Each compare-exchange retrieves and replaces
+     a pair of elements. Element k is compared with element k^mask. The pairs are split between the
+     workers and the call returns once the stage is complete.
+    @param arr The identifier for the array
+    @param mask The mask of the stage (i-1 for the first stage of a merge of size i, otherwise the stride)
+    */
+    void strided_stage(name_t arr, uint32_t mask);
+
+    /**
+    Applies the stages of the network with strides smaller than the chunk to every chunk. The chunks
+     are split between the workers (each worker holds one chunk in memory).
+    @param arr The identifier for the array
+    @param first The size of the first merge (merges of size first, 2*first, ..., last are applied)
+    @param last The size of the last merge
+    @param hash If true, the tag of each element is the hash value of its key
+    @param clear If true, the tags are cleared when the chunk is placed
+    */
+    void merge_chunks(name_t arr, uint32_t first, uint32_t last, bool hash, bool clear);
+
+    /**
+    Retrieves a chunk and applies the stages of the network with strides smaller than the chunk
+     in client memory with the branch-free kernel. Chunks are aligned, so these stages do not compare
+     elements of different chunks. The last chunk is completed with virtual elements.
+    @param arr The identifier for the array
+    @param offset The index of the first element of the chunk
+    @param first The size of the first merge
+    @param last The size of the last merge
+    @param hash If true, the tag of each element is the hash value of its key
+    @param clear If true, the tags are cleared when the chunk is placed
+    @param block Buffer for the elements of the chunk
+    @param words Buffer for the tag of each element packed with its position
+    */
+    void merge_chunk(name_t arr, uint32_t offset, uint32_t first, uint32_t last, bool hash, bool clear,
+            element **block, uint64_t *words);
+
 public:
-    explicit bitonic(server *cloud, uint32_t size):
+    /**
+    @param cloud The server that stores the array
+    @param size The length of the array
+    @param memory The number of elements that each thread holds in memory (rounded down to a power of two)
+    @param num_threads The number of threads that apply the stages
+    */
+    explicit bitonic(server *cloud, uint32_t size, uint32_t memory = SORT_MEMORY,
+            uint32_t num_threads = std::thread::hardware_concurrency()):
         ORP(cloud, size),
-        size(size)
-    {}
+        size(size),
+        pool((num_threads > 1) ? new thread_pool(num_threads) : nullptr)
+    {
+        assert(size >= 1 && memory >= 2);
+        padded = (size > 1) ? 1u << (32 - __builtin_clz(size - 1)) : 1;
+        // the largest power of two in client memory (at most the padded array)
+        chunk = 1u << (31 - __builtin_clz(memory));
+        chunk = std::min(chunk, padded);
+        if(pool != nullptr) {
+            // every worker has a chunk (a power of two)
+            uint32_t share = std::max(padded / pool->size(), 1u);
+            chunk = std::min(chunk, 1u << (31 - __builtin_clz(share)));
+        }
+    }
+
+    ~bitonic()
+    {
+        delete pool;
+    }
 
+    /**
+    Sorts the array by the hash values of the keys. The stages of the network with strides smaller
+     than the client memory run in memory over contiguous chunks, so the network makes about
+     log^2(n/M)/2 passes over the server instead of log^2(n)/2. Each key is hashed once, by the
+     first pass, and the network compares the hash values stored in the auxiliary information.
+    @param arr The identifier for the array
+    @return the identifier of the output array
+    */
     name_t permute(name_t arr) override;
+
+    /**
+    Obliviously sorts the array by precomputed tags: the tag of an element is the low 32 bits of its
+     auxiliary information. The tags are kept.
+    @param arr The identifier for the array
+    @return the identifier of the output array
+    */
+    name_t sort(name_t arr);
 };
 
 #endif //MY_PROJECT_BITONIC_H
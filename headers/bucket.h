@@ -5,10 +5,23 @@
 #ifndef MY_PROJECT_BUCKET_H
 #define MY_PROJECT_BUCKET_H
 
+#include <vector>
+#include <atomic>
 #include "../utils/server.h"
 #include "../utils/permutation.h"
+#include "../utils/thread_pool.h"
 #include "ORP.h"
 
+// default probability that a run of the butterfly network overflows (the run is then repeated)
+#ifndef BUCKET_FAILURE
+#define BUCKET_FAILURE (1.0 / (1ull << 40))
+#endif
+
+// number of repeated runs after which the permutation fails (the capacity is too small for the array)
+#ifndef BUCKET_MAX_RETRIES
+#define BUCKET_MAX_RETRIES 16
+#endif
+
 class bucket : public ORP
 {
 private:
@@ -16,73 +29,166 @@ private:
     // security parameter
     uint32_t Z;
     uint32_t B;
-    uint32_t seed;
+    // radix of the butterfly network (a power of two). Each step routes k buckets, so the client
+    // holds about k*Z elements
+    uint32_t k;
+    uint32_t log_k;
+    uint32_t num_levels;
+    // the first level of the butterfly network (non-zero when the run is resumed)
+    uint32_t start_level;
+    // workers for the steps of a level (nullptr if single threaded)
+    thread_pool *pool;
+    // a bucket of the current run overflowed (the run is repeated with a new permutation)
+    std::atomic<bool> overflow;
+    // number of runs that were repeated because of an overflow
+    uint32_t retries;
+    // the tag of each bucket of the final level (the tag that the butterfly network routes to it)
+    std::vector<uint32_t> bucket_tags;
+
+    /**
+    Writes a checkpoint of the run between two levels of the butterfly network.
+    @param level The next level of the network
+    @param arr The identifier for the input array of the next level
+    */
+    void save_checkpoint(uint32_t level, name_t arr);
+
+    /**
+    Follows every tag through the levels of the network to the final bucket that it reaches. Final
+     bucket q covers the destinations d with floor(d*B/n) = q, so an element is tagged with the tag
+     of the bucket that covers pi(key).
+    */
+    void set_bucket_tags();
+
 public:
-    explicit bucket(server *cloud, uint32_t power, uint32_t Z):
+    /**
+    @param cloud The server that stores the array
+    @param power The length of the array
+    @param Z The capacity of a bucket (an even number, or 0 for the smallest capacity that overflows
+     with probability at most BUCKET_FAILURE)
+    @param k The radix of the butterfly network (a power of two)
+    @param num_threads The number of threads that route the steps of a level
+    */
+    explicit bucket(server *cloud, uint32_t power, uint32_t Z = 0, uint32_t k = 2,
+            uint32_t num_threads = std::thread::hardware_concurrency()):
             ORP(cloud, power),
             size(power),
-            Z(Z),
-            seed(rand()),
-            B(0)
-    {}
+            Z((Z != 0) ? Z : capacity(power, k, BUCKET_FAILURE)),
+            B(0),
+            k(k),
+            num_levels(0),
+            start_level(0),
+            pool((num_threads > 1) ? new thread_pool(num_threads) : nullptr),
+            overflow(false),
+            retries(0)
+    {
+        assert(k >= 2 && (k & (k - 1)) == 0);
+        assert(this->Z >= 2 && this->Z % 2 == 0);
+        this->log_k = __builtin_ctz(k);
+    }
 
+    ~bucket()
+    {
+        delete pool;
+    }
+
+    /**
+    Permutes the array. If a bucket overflows, the run is repeated from the input with a new permutation.
+     The process exits with an error once BUCKET_MAX_RETRIES runs have been repeated.
+    @param arr The identifier for the input array
+    @return the identifier of the output array
+    */
     name_t permute(name_t arr) override;
 
     /**
-    Elements are assigned to buckets with a hash function.
-    Elements are routed into output buckets through a butterfly network.
-    @param arr The identifier for the input array.
-    @return The length of the output array.
+    Continues an interrupted permutation. Checkpoints are taken between the levels of the
+     butterfly network and hold the seed of pi (the bucket tags are derived from pi).
+    @param arr The identifier for the input array of the interrupted run
+    @return the identifier of the output array
     */
-    name_t butterfly(name_t arr);
+    name_t resume(name_t arr) override;
 
     /**
-    Non-oblivious permutation function.
+    @return the number of runs of the last permutation that were repeated because of an overflow
+    */
+    uint32_t get_retries() { return retries; }
+
+    /**
+    @param n The length of the array
+    @param Z The capacity of a bucket
+    @return the number of buckets (the smallest power of two that is at least 2n/Z)
+    */
+    static uint32_t num_buckets(uint32_t n, uint32_t Z);
+
+    /**
+    Computes the smallest bucket capacity for which the butterfly network overflows with at most
+     the given probability, from the bound B*ceil(log_k(B))*e^{-Z/6}.
+    @param n The length of the array
+    @param k The radix of the butterfly network
+    @param failure The probability that a run overflows
+    @return the capacity of a bucket (an even number)
+    */
+    static uint32_t capacity(uint32_t n, uint32_t k, double failure);
+
+    /**
+    Elements are tagged with the final bucket that covers their destination pi(key). Since pi is
+     uniformly random, the tags reveal nothing to the server.
+    Elements are routed into output buckets through a radix-k butterfly network. Each step of a
+     level reads k buckets and splits them on log_k bits of the tags into k buckets, so the network
+     makes ceil(log_k(B)) passes over the server. Every bucket of every level has an expected load
+     of Z/2, so a bucket overflows with probability at most e^{-Z/6} (Chernoff) and the network
+     overflows with probability at most B*ceil(log_k(B))*e^{-Z/6}.
+    The steps of a level read and write disjoint buckets, so they are split between the workers
+     (each worker holds the buckets of one step). The final level writes the permuted array directly.
     @param arr The identifier for the input array.
-    @return The length of the output array.
+    @return The identifier of the output array.
     */
-    name_t rearrange(name_t arr);
+    name_t butterfly(name_t arr);
 
     /**
-    Retrieves a bucket from the server.
+    Retrieves a bucket from the server with one read of its records. Only the real elements of the
+     bucket become elements in client memory.
     @param arr The identifier for the input array.
     @param width The width of the bucket.
     @param offset The index in the source array.
     @param buck Container to place the real elements of the bucket.
+    @param records Buffer for the records of the bucket (width records)
     */
-    void get_bucket(name_t arr, uint32_t offset, uint32_t index, std::vector<element *> *buck);
+    void get_bucket(name_t arr, uint32_t width, uint32_t offset, std::vector<element *> *buck, char *records);
 
     /**
-    Places a bucket of real and dummy elements at the server
+    Places a bucket of real and dummy elements at the server with one write of Z records. The dummy
+     records are filled by memset. A bucket with more than Z real elements sets the overflow flag and
+     keeps Z of them, so the server observes the same accesses for every bucket.
     @param arr The identifier for the array
     @param offset The index in the destination array
     @param buck Container to place the real elements of the bucket.
+    @param records Buffer for the records of the bucket (Z records)
     */
-    void put_bucket(name_t arr, uint32_t offset, std::vector<element *> *buck);
+    void put_bucket(name_t arr, uint32_t offset, std::vector<element *> *buck, char *records);
 
     /**
-    Splits an input bucket into two buckets based on permutation tags. The larger tags go in the
-     right bucket.
+    Splits an input bucket into output buckets based on permutation tags. An element goes to the
+     output bucket given by the bits [shift, shift + bits) of its tag.
     @param input The input bucket.
-    @param out_right The right output bucket.
-    @param out_left The left output bucket.
-    @param level The current level in the network.
+    @param out The output buckets (2^bits buckets).
+    @param shift The first tag bit of the current level.
+    @param bits The number of tag bits of the current level.
     */
     void split_input_bucket(std::vector<element *> *input,
-            std::vector<element *> *out_right,
-            std::vector<element *> *out_left,
-            uint32_t level);
+            std::vector<std::vector<element *>> *out,
+            uint32_t shift,
+            uint32_t bits);
 
     /**
     Completes the final round of the butterfly network.
-    Dummy elements are removed from buckets and the buckets are shuffled.
-    @param left The left input bucket.
-    @param right The right input bucket.
-    @param arr The identifier for the input array.
-    @param count The number of real elements placed in the output.
+    Dummy elements are removed and each bucket is sorted by destination. The output buckets of a
+     step cover a contiguous range of destinations, so the elements are written to the output array
+     in one sequential run instead of being rearranged by random accesses.
+    @param out The output buckets of the final step.
+    @param arr The identifier for the output array.
+    @param records Buffer for the records of a bucket (Z records)
     */
-    uint32_t final_round(std::vector<element *> *left, std::vector<element *> *right,
-            name_t arr, uint32_t count);
+    void final_round(std::vector<std::vector<element *>> *out, name_t arr, char *records);
 };
 
 #endif //MY_PROJECT_BUCKET_H
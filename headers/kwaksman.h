@@ -0,0 +1,174 @@
+/********************************************************************
+ A radix-k generalisation of the low memory Waksman permutation.
+
+ Each internal node of the network is split into k subnetworks by a
+ column of k x k entry switches and a column of k x k exit switches.
+ A network on n elements therefore has about log_k(n) levels and the
+ permutation makes about 2*log_k(n) passes over the server arrays,
+ compared to 2*log_2(n) for the binary network.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_KWAKSMAN_H
+#define MY_PROJECT_KWAKSMAN_H
+
+#include <cstdint>
+#include <vector>
+#include "../utils/permutation.h"
+#include "../utils/server.h"
+#include "ORP.h"
+
+/**
+    Structure of a node of the radix-k network.
+    The local subpermutation of a node is not stored. It is derived from the root permutation and the
+     ports of the switches of the ancestors (see kwaksman::eval_sigma), so the client only keeps a byte
+     for each edge of the nodes on the current path of the traversal (and the subpermutation of the
+     node that is configured).
+*/
+class radix_node
+{
+public:
+    radix_node *parent;
+    // the subnetwork of the parent that the node corresponds to
+    uint32_t colour;
+    uint32_t offset;
+    uint32_t size;
+    // entry_port[i*k + c] is the port of entry switch i that is routed to subnetwork c
+    std::vector<uint8_t> entry_port;
+
+    radix_node(radix_node *parent, uint32_t colour, uint32_t offset, uint32_t size):
+            parent(parent),
+            colour(colour),
+            offset(offset),
+            size(size)
+    {}
+};
+
+class kwaksman : public ORP
+{
+private:
+    uint32_t length;
+    // radix of the network (a power of two). Each switch is a k x k crossbar
+    uint32_t k;
+    uint32_t log_k;
+    // the network is padded to leaf_size*k^num_levels with virtual dummy elements
+    uint32_t padded;
+    // leaves have at most k*k elements and are permuted in client memory
+    uint32_t leaf_size;
+    uint32_t num_levels;
+    name_t input;
+    name_t temp1;
+    name_t temp2;
+    // the subpermutation of the node that is configured and its inverse
+    std::vector<uint32_t> sigma;
+    std::vector<uint32_t> inv_sigma;
+
+    /**
+    Performs network configuration and routing simultaneously.
+    The entry switches of the node are configured and elements are routed to the k subnetworks.
+    The exit port of each element is appended to its auxiliary information.
+    The procedure recurses into the k subnetworks of the node.
+    @param node The node of the subnetwork (released by the call)
+    @param source The identifier for the input array
+    */
+    void configuration_phase(radix_node *node, name_t source);
+
+    /**
+    Elements are stored at the server with the ports of their upcoming exit switches.
+    The empty road phase applies the exit switches level by level, from the leaves to the root.
+    @param source The identifier for the array that holds the output of the leaves
+    @return the identifier of the output array
+    */
+    name_t empty_road_phase(name_t source);
+
+    /**
+    Colours the edges of the k-regular bipartite multigraph between the entry switches and the
+     exit switches of a node. Edge x joins entry switch x/k to exit switch sigma(x)/k and its
+     colour is the subnetwork that the element is routed through.
+    The colouring is built from log_k rounds of the cycle traversal of set_exterior: each round
+     splits every colour class into two classes of half the degree. Within a class, the edges of
+     a switch are paired in port order, so the pairs are found from the k ports of the switch.
+    The node is given by sigma and inv_sigma.
+    @param colour Output vector of the colour of each edge
+    */
+    void colour_edges(std::vector<uint8_t> *colour);
+
+    /**
+    @param index An edge of the node
+    @param colour The colours of the edges of the node
+    @param mask The bits of the colour that identify the class of the current round
+    @return the other edge of the class of the edge at its entry switch
+    */
+    uint32_t entry_partner(uint32_t index, std::vector<uint8_t> *colour, uint32_t mask);
+
+    /**
+    @param index An edge of the node
+    @param colour The colours of the edges of the node
+    @param mask The bits of the colour that identify the class of the current round
+    @return the other edge of the class of the edge at its exit switch
+    */
+    uint32_t exit_partner(uint32_t index, std::vector<uint8_t> *colour, uint32_t mask);
+
+    /**
+    Route the elements of a leaf node. The leaf is retrieved in a single block and placed in
+     the destination array in output order.
+    @param node The leaf
+    @param source The identifier for the source array
+    @param dest The identifier for the destination array
+    */
+    void route_leaf(radix_node *node, name_t source, name_t dest);
+
+    /**
+    Evaluates the local subpermutation function. Virtual dummies are mapped to themselves.
+    @param node The node
+    @param index The input position in the node
+    @return sigma_{node}(index)
+    */
+    uint32_t eval_sigma(radix_node *node, uint32_t index);
+
+    /**
+    Retrieves an element from the server. Indices beyond the input length are virtual dummies
+     of the padded network and are created by the client.
+    @param source The identifier for the source array
+    @param index The index in the source array
+    */
+    element *get_elem(name_t source, uint32_t index);
+
+public:
+    explicit kwaksman(server *cloud, uint32_t size, uint32_t k):
+            ORP(cloud, size),
+            length(size),
+            k(k),
+            input(0),
+            temp1(0),
+            temp2(0)
+    {
+        // the colouring splits colour classes in half, so the radix must be a power of two
+        assert(k >= 2 && (k & (k - 1)) == 0);
+        this->log_k = __builtin_ctz(k);
+
+        // ports are stored in a byte
+        assert(k <= 256);
+
+        // use the fewest levels such that a leaf fits in a block of k*k elements
+        uint64_t width = 1;
+        this->num_levels = 0;
+        while ((size + width - 1) / width > k * k) {
+            width *= k;
+            num_levels++;
+        }
+        this->leaf_size = (size + width - 1) / width;
+        this->padded = leaf_size * width;
+        // the exit ports of an element are carried in its tag (log_k bits per level)
+        assert(num_levels * log_k <= TAG_BITS);
+    }
+
+    /**
+    Permute array according to pi. The network is padded with virtual dummies, which are routed to
+     the end of the padded array; the output array is trimmed to the input length.
+    @param name The identifier for the input array
+    @return the identifier of the output array
+    */
+    name_t permute(name_t name) override;
+};
+
+#endif //MY_PROJECT_KWAKSMAN_H
@@ -13,115 +13,286 @@
 
 #include <cmath>
 #include <algorithm>
+#include <vector>
+#include <atomic>
 #include "../utils/permutation.h"
 #include "../utils/server.h"
+#include "../utils/thread_pool.h"
 #include "ORP.h"
 
-// Identifiers for temporary arrays
-#define Ta 0x10000000
-#define Tb 0x10000001
-#define Tc 0x10000002
-#define Td 0x10000003
+// Identifier of the first temporary array (a shuffle pass with c phases uses c temporary arrays)
+#define MELB_TEMP 0x10000000
+
+// default probability that a bin of the shuffle overflows (the pass is then repeated)
+#ifndef MELBSHUFFLE_FAILURE
+#define MELBSHUFFLE_FAILURE (1.0 / (1ull << 40))
+#endif
+
+// number of repeated runs of a shuffle pass after which the permutation fails (the load parameter is
+// too small for the array)
+#ifndef MELBSHUFFLE_MAX_RETRIES
+#define MELBSHUFFLE_MAX_RETRIES 16
+#endif
+
+/**
+    Parameters of the Melbourne shuffle
+*/
+struct melb_options
+{
+    // load parameter of the phases (0 for the smallest parameters for which a shuffle overflows with
+    // probability at most MELBSHUFFLE_FAILURE)
+    uint32_t p = 0;
+    // number of distribution phases of a shuffle pass (at least 2). Each thread holds O(n^{1/c})
+    // elements in memory, and each phase makes a pass over the server
+    uint32_t c = 2;
+    // client memory of a thread in bytes. If it is not 0, c is the smallest number of phases that fits
+    // the memory (see melbshuffle::num_phases)
+    uint64_t memory = 0;
+};
+
+/**
+    Client memory of a worker, allocated once per phase and reused by every iteration of the phase
+*/
+struct melb_buffers
+{
+    // the records retrieved from the server
+    std::vector<char> records;
+    // the bin of each retrieved record
+    std::vector<uint32_t> bin_ids;
+    // the bins (bin b holds max_load records from index b*max_load)
+    std::vector<char> bins;
+    // the number of real records in each bin
+    std::vector<uint32_t> loads;
+
+    explicit melb_buffers(uint32_t retrieved, uint32_t placed, uint32_t num_bins):
+            records((size_t) retrieved*BYTESPERELEM),
+            bin_ids(retrieved),
+            bins((size_t) placed*BYTESPERELEM),
+            loads(num_bins)
+    {}
+};
+
+/**
+    Layout of a distribution phase. The phase reads groups (a group holds the elements whose
+     destinations are in a range of output buckets) one segment at a time and splits each segment
+     into radix bins, one for each subgroup. Subgroup d of group g is group g*radix + d of the
+     next phase, and bin s of a subgroup comes from segment s.
+*/
+struct melb_phase
+{
+    // number of groups (the first phase reads one group: the input array)
+    uint32_t groups;
+    // number of segments of a group (the segments of the first phase are the input buckets)
+    uint32_t segments;
+    // number of bins of the previous phase in a segment
+    uint32_t bins_per_segment;
+    uint32_t radix;
+    // number of output buckets that a subgroup covers
+    uint32_t span;
+    // load parameter of a bin (the maximum load divided by the rounded up expected load)
+    uint32_t p;
+    uint32_t max_load;
+};
 
 class melbshuffle : public ORP
 {
 private:
-    uint32_t p1;
-    uint32_t p2;
     uint32_t size;
-    // array is broken into buckets and a segment of buckets is a chunk
-    uint32_t num_chunks;
+    // number of distribution phases of a shuffle pass (the client holds O(n^{1/c}) elements)
+    uint32_t c;
+    // the output is broken into buckets of bucket_width elements
     uint32_t num_buckets;
-    uint32_t buckets_per_chunk;
     uint32_t bucket_width;
-    uint32_t chunk_width;
+    std::vector<melb_phase> phases;
+    // position of the run restored from a checkpoint (a shuffle pass and a phase of the pass)
+    uint32_t start_pass;
+    uint32_t start_phase;
+    name_t input;
+    // the largest segment that a phase retrieves, the largest set of bins that it places (in
+    // records) and the largest number of bins
+    uint32_t max_retrieved;
+    uint32_t max_placed;
+    uint32_t max_bins;
+    // workers for the segments of a phase (nullptr if single threaded)
+    thread_pool *pool;
+    // a bin of the current pass overflowed (the pass is repeated with a new permutation)
+    std::atomic<bool> overflow;
+    // number of passes that were repeated because of an overflow
+    uint32_t retries;
 
     /**
-    Performs a single shuffle of the input array.
-    As not all permutations are possible, the main function permute
-    executes shuffle_pass twice
-    @param I The identifier for the input array
-    @param T1 The identifier for the first temporary array
-    @param T2 The identifier for the second temporary array
-    @param O The identifier for the output array
+    Writes a checkpoint of the run between two phases.
+    @param pass The current shuffle pass
+    @param phase The next phase of the pass
     */
-    void shuffle_pass(name_t I, name_t T1, name_t T2, name_t O);
+    void save_checkpoint(uint32_t pass, uint32_t phase);
 
     /**
-    The input array is divided in buckets and chunks of buckets.
-    The first distribution phase places all elements in the correct chunks in the output.
-    Elements are placed in a temporary array and the chunks are padded with dummies so that they
-     have equal cardinality.
+    Performs a single shuffle of the input array.
+    As not all permutations are possible, the main function permute
+    executes shuffle_pass twice. If a bin overflows, the pass is repeated with a new permutation
+     (the accesses of a failed pass do not depend on the elements, so only the failure is revealed)
     @param I The identifier for the input array
-    @param T1 The identifier for the temporary array
+    @param T The identifier for the first temporary array (phase l writes array T+l)
+    @param O The identifier for the output array
+    @param pass The index of the pass (the phases of a resumed pass start from the checkpoint)
     */
-    void distribution_phase_1(name_t I, name_t T1);
+    void shuffle_pass(name_t I, name_t T, name_t O, uint32_t pass);
 
     /**
-    The input temporary array contains elements in the correct chunk
-    The second distribution phase places all elements in a chunk in the correct bucket.
-    Elements are placed in a temporary array and the chunks are padded with dummies so that they
-     have equal cardinality.
-    @param T1 The identifier for the input temporary array
-    @param T2 The identifier for the output temporary array
+    A distribution phase places every element of a group in the correct subgroup. Elements are
+     placed in a temporary array and the bins are padded with dummies so that they have equal
+     cardinality. Each segment writes its own bins, so the segments of all groups are split
+     between the workers.
+    The first phase splits the input buckets into the top-level groups and the last phase places
+     all elements in the correct output bucket.
+    @param l The index of the phase
+    @param I The identifier for the input array (the input of the pass or the previous temporary array)
+    @param T The identifier for the output temporary array
     */
-    void distribution_phase_2(name_t T1, name_t T2);
+    void distribution_phase(uint32_t l, name_t I, name_t T);
 
     /**
     The input temporary array contains elements in the correct bucket (with dummies) but not
      in the correct order.
-    The clean up phase places retrieves each bucket and places elements in the correct order
+    The clean up phase places retrieves each bucket and places elements in the correct order.
+     The destinations of the elements of a bucket are the range of the bucket in the output, so
+     each element is placed directly at its slot in O(width) instead of sorting the bucket.
+     The buckets are split between the workers.
     @param T The identifier for the input temporary array
     @param O The identifier for the output array
    */
     void cleanup_phase(name_t T, name_t O);
 
     /**
-    Places a bin in temporary storage. The bin is padded with dummies to have cardinality max_load.
-    Padding ensures that the bin loads are not revealed to the server.
-    @param name The identifier for the temporary output array
-    @param idx The starting index of the bin in the temporary array
-    @param bin The real elements in the bin
-    @param max_load The cardinality of the bin.
-   */
-    void put_bin(name_t T, uint32_t idx, std::vector<element*> *bin, uint32_t max_load);
+    Distributes retrieved records into the bins given by bin_ids. Records with a bin id of at least
+     num_bins (dummies) are dropped. The bins are padded with dummy records to max_load. A bin that
+     receives more than max_load records sets the overflow flag and keeps max_load of them.
+    @param buf The buffers of the worker
+    @param count The number of retrieved records
+    @param num_bins The number of bins
+    @param max_load The cardinality of a bin
+    */
+    void fill_bins(melb_buffers *buf, uint32_t count, uint32_t num_bins, uint32_t max_load);
 
     /**
-    Places a bucket (correctly ordered) in the output array
-    @param O The identifier for the output array
-    @param idx The starting index of the bucket in the output array
-    @param bucket The real elements in the bucket
-   */
-    void put_bucket(name_t O, uint32_t offset, std::vector<element*> *bucket);
+    Places the bins in temporary storage. Padding ensures that the bin loads are not revealed to
+     the server.
+    @param buf The buffers of the worker
+    @param T The identifier for the temporary output array
+    @param offset The index of the first bin in the temporary array
+    @param stride The distance between consecutive bins in the temporary array
+    @param num_bins The number of bins
+    @param max_load The cardinality of a bin
+    */
+    void put_bins(melb_buffers *buf, name_t T, uint32_t offset, uint32_t stride, uint32_t num_bins, uint32_t max_load);
+
+    /**
+    Computes the smallest load parameter for which the bins of a phase overflow with at most the
+     given probability. The load of a bin is hypergeometric, so the Chernoff bound
+     P[X >= a] <= e^{-mean} (e*mean/a)^a applies to each bin.
+    @param bins The number of bins of the phase
+    @param mean The expected load of a bin
+    @param scale The maximum load of a bin is the load parameter times scale
+    @param failure The probability that a bin of the phase overflows
+    @return the load parameter
+    */
+    static uint32_t load_parameter(double bins, double mean, uint32_t scale, double failure);
+
+    /**
+    Computes the layout of the phases of a shuffle.
+    @param n The length of the array
+    @param c The number of distribution phases
+    @param p The load parameter of every phase (0 for the smallest parameter for which a shuffle
+     overflows with probability at most MELBSHUFFLE_FAILURE)
+    @param phases Output layout of the phases
+    @return the width of an output bucket
+    */
+    static uint32_t layout(uint32_t n, uint32_t c, uint32_t p, std::vector<melb_phase> *phases);
 
     /**
-    Retrieves a contiguous segment of elements from an external array
-    @param name The identifier for the array
-    @param idx The starting index of the segment
-    @param range the length of the segment
-    @return the array name[idx...(range-1)]
+    @param n The length of the array
+    @param bucket_width The width of an output bucket
+    @param phases The layout of the phases
+    @param max_retrieved Output: the largest segment that a phase retrieves
+    @param max_placed Output: the largest number of records that a phase places at once
+    @param max_bins Output: the largest number of bins of a segment
     */
-    element **get_range(name_t name, int idx, uint32_t range);
+    static void buffer_sizes(uint32_t n, uint32_t bucket_width, std::vector<melb_phase> const& phases,
+            uint32_t *max_retrieved, uint32_t *max_placed, uint32_t *max_bins);
 
 public:
-    explicit melbshuffle(server *cloud, uint32_t size, uint32_t p1, uint32_t p2):
+    /**
+    @param cloud The server that stores the array
+    @param size The length of the array
+    @param options The load parameter and the number of phases (or the client memory) of the shuffle
+    @param num_threads The number of threads that process the segments and buckets of a phase
+    */
+    explicit melbshuffle(server *cloud, uint32_t size, melb_options const& options = melb_options(),
+            uint32_t num_threads = std::thread::hardware_concurrency()):
             ORP(cloud, size),
             size(size),
-            p1(p1),
-            p2(p2)
+            c((options.memory != 0) ? num_phases(size, options.memory) : options.c),
+            start_pass(0),
+            start_phase(0),
+            input(0),
+            pool((num_threads > 1) ? new thread_pool(num_threads) : nullptr),
+            overflow(false),
+            retries(0)
     {
+        assert(c >= 2);
         printf("size: %d\n", size);
-        this->num_buckets = (uint32_t) ceil(sqrt(size));
-        this->bucket_width = (uint32_t) ceil(sqrt(size));
-        if(bucket_width*num_buckets - bucket_width >= size) {
-            bucket_width--;
-        }
-        this->num_chunks = (uint32_t) ceil(pow(size, 0.25));
-        this->buckets_per_chunk = ceil((double) num_buckets / (double) num_chunks);
-        this->chunk_width = buckets_per_chunk * bucket_width;
+        bucket_width = layout(size, c, options.p, &phases);
+        num_buckets = (size + bucket_width - 1) / bucket_width;
+        buffer_sizes(size, bucket_width, phases, &max_retrieved, &max_placed, &max_bins);
     }
 
+    ~melbshuffle()
+    {
+        delete pool;
+    }
+
+    /**
+    Permutes the array with two shuffle passes. A pass in which a bin overflows is repeated with a
+     new permutation. The process exits with an error once a pass has been repeated
+     MELBSHUFFLE_MAX_RETRIES times.
+    @param input The identifier for the input array
+    @return the identifier of the output array
+    */
     name_t permute(name_t input) override;
+
+    /**
+    Continues an interrupted permutation. Checkpoints are taken between the phases of the two
+     shuffle passes and hold the seed of the permutation of the current pass.
+    @param input The identifier for the input array of the interrupted run
+    @return the identifier of the output array
+    */
+    name_t resume(name_t input) override;
+
+    /**
+    @return the number of passes of the last permutation that were repeated because of an overflow
+    */
+    uint32_t get_retries() { return retries; }
+
+    /**
+    @return the number of distribution phases of a shuffle pass
+    */
+    uint32_t get_c() { return c; }
+
+    /**
+    @param l The index of a distribution phase
+    @return the load parameter of the phase
+    */
+    uint32_t get_p(uint32_t l) { return phases[l].p; }
+
+    /**
+    Computes the smallest number of distribution phases for which a thread of the shuffle fits in
+     the given client memory.
+    @param n The length of the array
+    @param memory The client memory of a thread in bytes
+    @return the number of phases (c)
+    */
+    static uint32_t num_phases(uint32_t n, uint64_t memory);
 };
 
 #endif //MY_PROJECT_MELBSHUFFLE_H
@@ -0,0 +1,120 @@
+//
+// Batcher's odd-even merge sort.
+//
+
+#ifndef MY_PROJECT_ODDEVEN_H
+#define MY_PROJECT_ODDEVEN_H
+
+#include <vector>
+#include <algorithm>
+#include "../utils/server.h"
+#include "../utils/permutation.h"
+#include "../utils/compare_exchange.h"
+#include "../utils/thread_pool.h"
+#include "ORP.h"
+
+class oddeven : public ORP
+{
+private:
+    uint32_t size;
+    // the network on size elements is the network on padded elements (a power of two) with virtual
+    // maximal elements at the end. Comparators with a virtual element never swap, so they are skipped
+    uint32_t padded;
+    // number of elements in a chunk of client memory (a power of two)
+    uint32_t chunk;
+    // workers for the stages (nullptr if single threaded)
+    thread_pool *pool;
+
+    /**
+    Sorts the array by the tags of the elements.
+    @param arr The identifier for the array
+    @param hash If true, the tags are the hash values of the keys. They are written to the auxiliary
+     information by the first pass and cleared by the last stage that compares them
+    @return the identifier of the output array
+    */
+    name_t network(name_t arr, bool hash);
+
+    /**
+    Applies a stage of the network at the server. Each compare-exchange retrieves and replaces
+     a pair of elements. The pairs are split between the workers and the call returns once the
+     stage is complete.
+    @param arr The identifier for the array
+    @param p Half the size of the merges
+    @param k The stride of the stage
+    @param clear If true, the stage is part of the last merge and clears the tags of the elements
+     that no later stage compares
+    */
+    void strided_stage(name_t arr, uint32_t p, uint32_t k, bool clear);
+
+    /**
+    Sorts every chunk in client memory. The chunks are split between the workers (each worker holds
+     one chunk in memory).
+    @param arr The identifier for the array
+    @param hash If true, the tag of each element is the hash value of its key
+    @param clear If true, the tags are cleared when the chunks are placed
+    */
+    void sort_chunks(name_t arr, bool hash, bool clear);
+
+    /**
+    Retrieves a chunk and sorts it in client memory with the branch-free kernel (every merge of at
+     most one chunk). The last chunk is completed with virtual elements.
+    @param arr The identifier for the array
+    @param offset The index of the first element of the chunk
+    @param hash If true, the tag of each element is the hash value of its key
+    @param clear If true, the tags are cleared when the chunk is placed
+    @param block Buffer for the elements of the chunk
+    @param words Buffer for the tag of each element packed with its position
+    */
+    void sort_chunk(name_t arr, uint32_t offset, bool hash, bool clear, element **block, uint64_t *words);
+
+public:
+    /**
+    @param cloud The server that stores the array
+    @param size The length of the array
+    @param memory The number of elements that each thread holds in memory (rounded down to a power of two)
+    @param num_threads The number of threads that apply the stages
+    */
+    explicit oddeven(server *cloud, uint32_t size, uint32_t memory = SORT_MEMORY,
+            uint32_t num_threads = std::thread::hardware_concurrency()):
+        ORP(cloud, size),
+        size(size),
+        pool((num_threads > 1) ? new thread_pool(num_threads) : nullptr)
+    {
+        assert(size >= 1 && memory >= 2);
+        padded = (size > 1) ? 1u << (32 - __builtin_clz(size - 1)) : 1;
+        chunk = 1u << (31 - __builtin_clz(memory));
+        chunk = std::min(chunk, padded);
+        if(pool != nullptr) {
+            // every worker has a chunk (a power of two)
+            uint32_t share = std::max(padded / pool->size(), 1u);
+            chunk = std::min(chunk, 1u << (31 - __builtin_clz(share)));
+        }
+    }
+
+    ~oddeven()
+    {
+        delete pool;
+    }
+
+    /**
+    Sorts the array by the hash values of the keys. The network has fewer comparators than the
+     bitonic network. The stages of a merge with strides smaller than a chunk compare elements across
+     chunk boundaries (the comparators of stride k < p start at odd multiples of k), so only merges of
+     at most one chunk run in client memory and the larger merges are applied at the server. Each
+     key is hashed once, by the first pass, and the network compares the hash values stored in the
+     auxiliary information.
+    @param arr The identifier for the array
+    @return the identifier of the output array
+    */
+    name_t permute(name_t arr) override;
+
+    /**
+    Obliviously sorts the array by precomputed tags: the tag of an element is the low 32 bits of its
+     auxiliary information. The tags are kept.
+    @param arr The identifier for the array
+    @return the identifier of the output array
+    */
+    name_t sort(name_t arr);
+};
+
+#endif //MY_PROJECT_ODDEVEN_H
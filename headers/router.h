@@ -0,0 +1,102 @@
+/********************************************************************
+ Routing engine for a configured Waksman network.
+
+ A router applies a network configuration (computed once by
+ waksman::configure or retained by waksman::permute) to any number
+ of arrays. Several columns of a table are routed together, so each
+ level of the network is a single pass over every column.
+ Running the switches from the outputs to the inputs applies the
+ inverse permutation with the same configuration.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_ROUTER_H
+#define MY_PROJECT_ROUTER_H
+
+#include <cstdint>
+#include <vector>
+#include "../utils/server.h"
+#include "../utils/network_config.h"
+
+// Identifiers for temporary arrays (one for each routed column)
+#define ROUTE_TEMP 0x20000000
+
+enum route_stage {ENTRY, LEAF, EXIT};
+
+class router
+{
+private:
+    server *cloud;
+    network_config *config;
+    uint32_t length;
+    uint32_t leaf_size;
+    uint32_t num_levels;
+    // index of the settings of the next node in the current level
+    uint64_t cursor;
+    // route the reversed network (exit switches are applied as entry switches and vice versa)
+    bool inverse;
+
+    /**
+    Routes a set of arrays through the levels of the network.
+    @param columns The identifiers for the arrays
+    */
+    void route_network(std::vector<name_t> const& columns);
+
+    /**
+    Visits the nodes of a level of the permutation tree from left to right.
+    @param offset The index of the first element of the current node
+    @param size The size of the current node
+    @param depth The depth of the current node
+    @param level The level of the nodes to be routed
+    @param stage The switches applied to the nodes of the level
+    @param source The identifiers for the source arrays
+    @param dest The identifiers for the destination arrays
+    */
+    void route_level(uint32_t offset, uint32_t size, uint32_t depth, uint32_t level, route_stage stage,
+            std::vector<name_t> *source, std::vector<name_t> *dest);
+
+    /**
+    Routes the elements of a node through its entry switches. The top and bottom halves of the
+     destination range are the inputs of the left and right subnetworks.
+    */
+    void route_entry(uint32_t offset, uint32_t size, uint32_t level, std::vector<name_t> *source,
+            std::vector<name_t> *dest);
+
+    /**
+    Routes the outputs of the two subnetworks of a node through its exit switches.
+    */
+    void route_exit(uint32_t offset, uint32_t size, uint32_t level, std::vector<name_t> *source,
+            std::vector<name_t> *dest);
+
+    /**
+    Permutes the elements of a leaf in client memory. The leaf is placed back in the source array.
+    */
+    void route_leaf(uint32_t offset, uint32_t size, std::vector<name_t> *source);
+
+public:
+    explicit router(server *cloud, network_config *config):
+            cloud(cloud),
+            config(config),
+            length(config->get_length()),
+            leaf_size(config->get_leaf_size()),
+            num_levels(config->num_levels()),
+            cursor(0),
+            inverse(false)
+    {}
+
+    /**
+    Permutes a set of arrays according to the configured network.
+    Arrays are routed together and are permuted in place.
+    @param columns The identifiers for the arrays
+    */
+    void route(std::vector<name_t> const& columns);
+
+    /**
+    Applies the inverse permutation to a set of arrays. The switch settings are applied from
+     the outputs of the network to the inputs, so no reconfiguration is required.
+    Arrays are routed together and are permuted in place.
+    @param columns The identifiers for the arrays
+    */
+    void route_inverse(std::vector<name_t> const& columns);
+};
+
+#endif //MY_PROJECT_ROUTER_H
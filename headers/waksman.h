@@ -10,8 +10,13 @@
 #include <climits>
 #include <bitset>
 #include <vector>
+#include <memory>
+#include <atomic>
 #include "../utils/permutation.h"
 #include "../utils/server.h"
+#include "../utils/network_config.h"
+#include "../utils/thread_pool.h"
+#include "../utils/block_permute.h"
 #include "ORP.h"
 
 #define PERSIST true
@@ -20,11 +25,63 @@
 #define EVEN 0
 #define ODD 1
 
+// stages of a checkpointed run
+#define CONFIGURATION_STAGE 0
+#define EMPTY_ROAD_STAGE 1
+
 typedef uint32_t name_t;
 using namespace std;
 #define clz(x) __builtin_clz(x)
 
 typedef std::vector<bool> bitvector;
+// bits packed in 64-bit words (supports word-level search)
+typedef std::vector<uint64_t> packed_bitvector;
+
+inline bool get_bit(packed_bitvector *bits, uint32_t index)
+{
+    return (bits->at(index / 64) >> (index % 64)) & 1u;
+}
+
+inline void set_bit(packed_bitvector *bits, uint32_t index)
+{
+    bits->at(index / 64) |= (uint64_t) 1u << (index % 64);
+}
+
+// nodes of at least this size configure their exterior in parallel
+#ifndef PARALLEL_THRESHOLD
+#define PARALLEL_THRESHOLD 65536
+#endif
+
+// power of two networks route subnetworks of at most this size in client memory
+#ifndef PERMUTE_BLOCK
+#define PERMUTE_BLOCK MAX_PERMUTE_BLOCK
+#endif
+static_assert(PERMUTE_BLOCK >= 4 && PERMUTE_BLOCK <= MAX_PERMUTE_BLOCK, "unsupported block size");
+static_assert(sizeof(element*) == sizeof(uint64_t), "elements are permuted as 64-bit words");
+
+// with checkpoints, the configuration phase is checkpointed at the boundaries of subtrees of at least this size
+#ifndef CHECKPOINT_SUBTREE
+#define CHECKPOINT_SUBTREE 65536
+#endif
+// depth limit for the roots of the checkpointed subtrees (the nodes above them are checkpointed individually)
+#define MAX_SPLIT_DEPTH 11
+
+// maximum number of levels of the empty road phase that are routed concurrently
+#ifndef PIPELINE_LEVELS
+#define PIPELINE_LEVELS 8
+#endif
+
+/**
+    An element on a wire that skips levels, waiting to be placed at the server
+*/
+struct pending_wire
+{
+    name_t array;
+    uint32_t index;
+    // the depth of the node whose input holds the element
+    uint32_t depth;
+    element *elem;
+};
 
 /**
     Structure for handling data during the execution of set exterior
@@ -96,29 +153,178 @@ private:
     uint32_t leaf_size;
     name_t temp1;
     name_t temp2;
+    // with checkpoints, the levels below the split depth alternate between temp3 and one of the other arrays,
+    // and the levels of the empty road phase keep the input of the last checkpointed level
     name_t temp3;
+    // depth of the roots of the subtrees that are checkpointed as a whole (see level_array)
+    uint32_t split_depth;
+    // the array that holds the inputs of the next level of the empty road phase
+    name_t road_input;
     // skip arrays contain elements that skip levels at the end of the configuration phase.
     // the skip array reduces the number of temporary arrays at the server
     name_t skip_array;
     uint32_t *skip_indices;
+    // start of the segment of each destination level in the skip array
+    uint32_t *skip_base;
+    // number of internal levels of the permutation tree
+    uint32_t height;
+    // switch settings of the network (recorded when the configuration is retained)
+    network_config *config;
+    bool retain;
+    // workers for configuring large exteriors (nullptr if single threaded)
+    thread_pool *pool;
+    // position of the run restored from a checkpoint: the number of nodes routed in the configuration
+    // phase (in preorder) or the depth of the next level of the empty road phase
+    uint32_t resume_stage;
+    uint64_t resume_progress;
+    std::vector<uint32_t> resume_skips;
+    // number of nodes visited by the configuration phase
+    uint64_t visited;
+    // elements on wires that skip levels from the last routed node. With checkpoints, they are placed
+    // after the checkpoint of the node because they may overwrite its inputs
+    std::vector<pending_wire> pending_wires;
+    // elements on wires from the nodes above the split depth to the nodes below it. A subtree of the split
+    // depth is routed again after a resume, so the elements are kept until their subtree is complete
+    std::vector<pending_wire> subtree_wires;
+    // progress of the levels of a pipelined empty road phase: every node of depth d that ends before
+    // watermark[d] has been routed
+    bool pipelined;
+    std::unique_ptr<std::atomic<uint32_t>[]> watermark;
+    std::mutex level_lock;
+    std::condition_variable level_done;
+
+    /**
+    Writes a checkpoint of the run. The server arrays and the checkpoint describe the run.
+    @param stage The current phase (CONFIGURATION_STAGE or EMPTY_ROAD_STAGE)
+    @param progress The number of routed nodes, or the depth of the next level of the empty road phase
+    */
+    void save_checkpoint(uint32_t stage, uint64_t progress);
+
+    /**
+    Places the elements on wires that skip levels from the last routed node.
+    */
+    void place_wires();
+
+    /**
+    Keeps the elements on the pending wires that end below the split depth, and releases the kept elements
+     of the complete subtrees.
+    @param boundary The index of the first element of the subtrees that are not complete
+    */
+    void keep_wires(uint32_t boundary);
+
+    /**
+    @param size The size of a node
+    @param leaf The largest size of a leaf
+    @return the number of nodes in the subtree of the node
+    */
+    static uint64_t count_nodes(uint32_t size, uint32_t leaf);
+
+    /**
+    Determines the size of a leaf. Leaf sizes are chosen so that all leaves have the same depth.
+    */
+    /**
+    Chooses the depth of the subtrees that are checkpointed as a whole. The subtrees are at least
+     CHECKPOINT_SUBTREE elements and their roots are above the lowest internal nodes, which write back
+     into the arrays of their ancestors. Without such a depth every internal node is checkpointed.
+    @param lowest The depth of the lowest internal nodes that are routed at the server
+    */
+    void set_split_depth(uint32_t lowest);
+
+    /**
+    Nodes of depth i are routed from temp1 if i is odd and from temp2 otherwise. With checkpoints, the
+     levels below the split depth alternate between the array of the level below it and temp3, so the
+     inputs of a subtree of the split depth are kept until the subtree is routed.
+    @param depth The depth of the nodes
+    @return the identifier for the array that the nodes of the depth are routed from
+    */
+    name_t level_array(uint32_t depth);
+    void set_leaf_size();
+
+    /**
+    Sizes the segments of the skip array. The elements that skip levels, and their destination levels,
+     only depend on the shape of the permutation tree, so the segments are counted before the
+     configuration phase and the skip array is no larger than the number of skipping wires.
+    @return the length of the skip array
+    */
+    uint32_t set_skip_segments();
+
+    /**
+    Subroutine of set_skip_segments that counts the skip elements of the leaves of a subtree.
+    @param node The root of the subtree
+    */
+    void count_skips(perm_node *node);
 
     /**
     Performs network configuration and routing simultaneously.
     The exterior of the network node is set and elements are routed to the next level.
     The procedure recurses into the two subnetworks of the node.
+    The routing is specialised at compile time for networks whose size is a power of two. Every
+     subnetwork is then even, no element skips a level and wire indices are computed with shifts.
+    When the run is resumed, subtrees that were routed before the checkpoint are skipped and the
+     exteriors of routed ancestors are recomputed (they only depend on pi).
+    With checkpoints, a checkpoint is written after every internal node above the split depth (its
+     children overwrite its inputs) and after a subtree of the split depth once the checkpoint interval
+     has passed.
     @param node The input node that corresponds to a subnetwork
-    @param array The identifier for the input array
     */
-    void configuration_phase(perm_node *node, name_t array);
+    template<bool pow2>
+    void configuration_phase(perm_node *node);
+
+    /**
+    Configures the subnetwork of a node and its descendants without routing elements.
+    The switch settings are appended to the configuration.
+    @param node The input node that corresponds to a subnetwork
+    */
+    void configure_node(perm_node *node);
 
     /**
     Elements are stored at the server with the values of their upcoming switches.
     The empty road phase routes elements through the second half of the network by
      iterating through the remaining switches.
+    With multiple threads and without checkpoints, consecutive levels are pipelined (see pipeline_levels).
+    With checkpoints, a level is written to an array that holds neither its input nor the input of the
+     level of the last checkpoint, so a checkpoint is written once the checkpoint interval has passed.
     @return the identifier of the output array
     */
+    template<bool pow2>
     name_t empty_road_phase();
 
+    /**
+    Routes a window of levels of the empty road phase concurrently (one worker of the pool for each
+     level, so the window is at most the size of the pool).
+    A node writes its outputs into the range of its parent, which holds the inputs of the level below
+     (the two arrays alternate between levels). A node is routed once the level below has routed every
+     node in the range of its parent, which is also when the inputs of the node are complete. Nodes of a
+     level are routed from left to right, so the progress of a level is a single watermark.
+    @param top The deepest level of the window
+    @param bottom The shallowest level of the window
+    */
+    template<bool pow2>
+    void pipeline_levels(uint32_t top, uint32_t bottom);
+
+    /**
+    Routes the nodes of a depth through their exit switches.
+    @param depth The depth of the nodes
+    @param source The identifier for the array that holds the outputs of the level below
+    @param dest The identifier for the destination array
+    */
+    template<bool pow2>
+    void route_level_erp(uint32_t depth, name_t source, name_t dest);
+
+    /**
+    Blocks until the nodes of a level have been routed up to an index (pipelined empty road phase only).
+    @param depth The depth of the level
+    @param end The index
+    */
+    void wait_for_level(uint32_t depth, uint32_t end);
+
+    /**
+    Advances the watermark of a level (pipelined empty road phase only).
+    @param depth The depth of the level
+    @param end The index after the last routed node
+    */
+    void publish_level(uint32_t depth, uint32_t end);
+
     /**
     Configures the exterior switches of the subnetwork that corresponds to node.
     The subpermutation function and the switches form a 2-regular bipartite graph. Set_exterior
@@ -128,6 +334,17 @@ private:
     */
     void set_exterior(perm_node *node);
 
+    /**
+    Parallel version of set_exterior for large nodes.
+    The traversal from an input wire to its switch sibling and then along the exit switch to the
+     next input wire is a permutation of the wires, and all wires in a cycle of this permutation
+     are routed to the same subnetwork. Cycles are labelled by their minimum wire with pointer
+     jumping (log n rounds of independent updates) and paired cycles are coloured by comparing
+     labels. An odd node is completed with a phantom wire that is mapped to itself.
+    @param node The input node that corresponds to a subnetwork
+    */
+    void set_exterior_parallel(perm_node *node);
+
     /**
     Set the next switch (colour) in the traversal. The permutation function determines the edge and the next
      switch setting (colour) is determined by the setting (colour) of the current switch in the traversal
@@ -136,24 +353,49 @@ private:
     @param settings The switch settings of the target switches
     @param is_set Boolean vector that says which switches are set.
     */
-    static void set_switch(ext_data *data, uint32_t *res, bitvector *settings, bitvector *is_set);
+    static void set_switch(ext_data *data, uint32_t *res, bitvector *settings, packed_bitvector *is_set);
 
     /**
-    Route the elements of a leaf node. All elements from the node are retrieved and routed according
-     to the subpermutation values through the subroutine route_element.
+    Route the elements of a leaf node. All elements from the node are retrieved with one read and routed
+     according to the subpermutation values through the subroutine route_element.
+    In a power of two network the leaves of the configuration phase are blocks of at most PERMUTE_BLOCK
+     elements (see route_blocks), and a leaf is only reached when the root is a block.
     @param node The input node that corresponds to the subnetwork of the leaf
     @param source The identifier for the source array
+    @param dest The identifier for the destination array (the array the parent was routed from)
     */
-    void route_leaf(perm_node *node, name_t source);
+    template<bool pow2>
+    void route_leaf(perm_node *node, name_t source, name_t dest);
+
+    /**
+    Routes the blocks of a power of two network: the root if it is a block, or otherwise the two children
+     of a node. The outputs of sibling blocks are interleaved, so the blocks are retrieved and placed in the
+     level above together, with one read and one write. Each block is permuted in client memory by its
+     Benes network, which removes the bottom levels of both phases.
+    @param node The root block or the parent of two blocks
+    @param source The identifier for the array that holds the inputs of the blocks
+    @param dest The identifier for the destination array (the array the node was routed from)
+    */
+    void route_blocks(perm_node *node, name_t source, name_t dest);
+
+    /**
+    Permutes the records of a block by the Benes network of its local subpermutation.
+    @param block The node of the block
+    @param records The input records of the block
+    @param output Output buffer. Output j of the block is placed at record (j << shift)
+    @param shift 1 if the outputs are interleaved with the outputs of the sibling, 0 otherwise
+    */
+    void permute_records(perm_node *block, char const *records, char *output, uint32_t shift);
 
     /**
     Subroutine of route_leaf that places an element in its correct position according to the network wires.
     @param node The input node that corresponds to the subnetwork of the leaf.
     @param elem The element to be routed.
     @param poff The offset in the destination array.
+    @param value The subpermutation value of the element.
     @param dest The identifier for the destination array.
     */
-    void route_element(perm_node *node, element *elem, uint32_t poff, uint32_t dest);
+    void route_element(perm_node *node, element *elem, uint32_t poff, uint32_t value, name_t dest);
 
     /**
     Follows network wires for elements that skip levels.
@@ -162,10 +404,15 @@ private:
     Elements in the skip array are retrieved during the empty road phase.
     @param node The input node that corresponds to the subnetwork of the leaf.
     @param elem The element to be routed.
-    @param poff The offset in the skip array.
-    @param dest The index to determine the number of skip elements in the destination level.
     */
-    void skip_fn(perm_node *node, element *element, uint32_t off, uint32_t index);
+    void skip_fn(perm_node *node, element *element);
+
+    /**
+    Determines the destination level of an element that skips levels from the bottom output of a leaf.
+    @param node The input node that corresponds to the subnetwork of the leaf.
+    @return The number of levels skipped after the first level.
+    */
+    static uint32_t skip_level(perm_node *node);
 
     /**
     Routes the elements of an internal node during the configuration phase.
@@ -173,6 +420,7 @@ private:
     @param source The identifier for the source array.
     @param dest The identifier for the destination array.
     */
+    template<bool pow2>
     void route_internal_node_cp(perm_node *node, name_t source, name_t dest);
 
     /**
@@ -181,9 +429,9 @@ private:
     @param size The of the current subnetwork.
     @param perm_value The subpermutation value of the element
     @param index The index in the destination array
-    @param dest The identifier for the destination array.
+    @param depth The depth of the subnetwork
     */
-    void route_wire(element *element, uint32_t size, uint32_t perm_value, uint32_t index, name_t dest);
+    void route_wire(element *element, uint32_t size, uint32_t perm_value, uint32_t index, uint32_t depth);
 
     /**
     Routes the elements of a switch during the configuration phase.
@@ -214,7 +462,7 @@ private:
     @param dest The identifier for the destination array.
     @param s_index The index of the next item in the skip array.
     */
-    uint32_t preorder_trav(perm_node *node, int depth, name_t source, name_t dest, uint32_t s_index);
+    uint32_t preorder_trav(perm_node *node, uint32_t depth, name_t source, name_t dest, uint32_t s_index);
 
     /**
     Routes the elements of an internal node during the empty road phase.
@@ -278,6 +526,14 @@ private:
     */
     uint32_t eval_pi(perm_node *node, uint32_t key);
 
+    /**
+    Evaluates the local subpermutation function for every input of a block. The inputs are followed
+     through the entry switches of the ancestors together, one level at a time.
+    @param block The node of the block
+    @param dest Output buffer (dest[i] = pi_{block}(i))
+    */
+    void eval_pi_block(perm_node *block, uint32_t *dest);
+
     /**
     Evaluates the local subpermutation function.
     @param node The input node that corresponds to the subnetwork.
@@ -287,13 +543,91 @@ private:
     uint32_t eval_inv_pi(perm_node *node, uint32_t key);
 
 public:
-    explicit waksman(server *cloud, uint32_t size):
+    /**
+    @param cloud The server that stores the array
+    @param size The length of the array
+    @param num_threads The number of threads that configure large exteriors and route the levels.
+     With more than one thread a node of at least PARALLEL_THRESHOLD elements is configured in client
+     buffers of about 19 bytes for each of its elements, rather than with bitvectors
+    */
+    explicit waksman(server *cloud, uint32_t size, uint32_t num_threads = 1):
             ORP(cloud, size),
-            length(size)
+            length(size),
+            split_depth(1),
+            road_input(0),
+            skip_indices(nullptr),
+            config(nullptr),
+            retain(false),
+            pool((num_threads > 1) ? new thread_pool(num_threads) : nullptr),
+            resume_stage(CONFIGURATION_STAGE),
+            resume_progress(0),
+            visited(0),
+            pipelined(false)
     {}
 
+    ~waksman()
+    {
+        delete config;
+        delete pool;
+    }
+
     name_t permute(name_t name) override;
 
+    /**
+    Continues an interrupted permutation. The children of a node overwrite the inputs of the node, so
+     with checkpoints the subtrees below the split depth are routed between temp3 and another array and
+     their inputs are kept until they complete. A checkpoint is written after every internal node above
+     the split depth, and periodically after the subtrees of the split depth and the levels of the empty
+     road phase (the nodes after the last checkpoint are routed again). The checkpoint holds the seed of
+     pi, the position of the run, the skip counts and the wires of the last routed node. A retained
+     configuration is recomputed once the permutation completes.
+    Checkpoints add a temporary array of the input length at the server.
+    @param name The identifier for the input array of the interrupted run
+    @return the identifier of the output array
+    */
+    name_t resume(name_t name) override;
+
+    /**
+    Computes the switch configuration of the network for pi without routing an array.
+    The configuration can be applied to any number of arrays with a router.
+    @return the configuration of the network
+    */
+    network_config *configure();
+
+    /**
+    The switch settings computed by subsequent calls to permute are retained and can be
+     exported with get_config.
+    */
+    void retain_configuration() {retain = true;}
+
+    /**
+    @return the configuration computed by the last call to configure or permute (if retained)
+    */
+    network_config *get_config() {return config;}
+
+    /**
+    Replaces the configuration with an exported configuration. The waksman object takes
+     ownership of the configuration.
+    @param exported A configuration of a network with the same length
+    */
+    void set_config(network_config *exported)
+    {
+        assert(exported->get_length() == length);
+        if(exported != config) {
+            delete config;
+        }
+        config = exported;
+    }
+
+    /**
+    Restores the original order of an array permuted by pi. The retained (or exported)
+     configuration is routed from the outputs of the network to the inputs, which applies
+     pi^{-1} without a configuration phase. If no configuration is available it is computed.
+    @param name The identifier for the permuted array
+    @return the identifier of the output array
+    */
+    name_t unpermute(name_t name);
+
     static void print_terminal(bool setting)
     {
         if(setting == PERSIST) {
@@ -307,11 +641,21 @@ public:
 
     /**
     Method is used during set_exterior to (efficiently) locate new cycles.
-    @param bitvec A bitvector.
+    The bitvector is searched a word at a time with a bit scan.
+    @param bitvec A packed bitvector.
     @param index The previous lowest index of a false value in the bitvector.
-    @return The lowest index of a false value.
+    @param length The number of bits in the bitvector.
+    @return The lowest index of a false value (or length if every bit is set).
     */
-    static uint32_t next_null(bitvector *bitvec, uint32_t index);
+    static uint32_t next_null(packed_bitvector *bitvec, uint32_t index, uint32_t length);
 };
 
+// routing specialisations for general and power of two network sizes
+template<> void waksman::route_level_erp<false>(uint32_t depth, name_t source, name_t dest);
+template<> void waksman::route_level_erp<true>(uint32_t depth, name_t source, name_t dest);
+template<> void waksman::route_leaf<false>(perm_node *node, name_t source, name_t dest);
+template<> void waksman::route_leaf<true>(perm_node *node, name_t source, name_t dest);
+template<> void waksman::route_internal_node_cp<false>(perm_node *node, name_t source, name_t dest);
+template<> void waksman::route_internal_node_cp<true>(perm_node *node, name_t source, name_t dest);
+
 #endif //MY_PROJECT_WAKSMAN_H
\ No newline at end of file
@@ -0,0 +1,26 @@
+/********************************************************************
+ A bucket capacity far below bucket::capacity overflows in every run,
+ so the permutation must stop after BUCKET_MAX_RETRIES repeated runs
+ and report the error (checked by the output of the test).
+ *********************************************************************/
+
+#include <cstdio>
+#include "../utils/server.h"
+#include "../headers/bucket.h"
+
+int main()
+{
+    uint32_t size = 1000;
+    auto *cloud = new server(64);
+    cloud->create_array(0, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud->put(0, i, new element(i, 0, nullptr));
+    }
+
+    bucket buck(cloud, size, 2, 2, 1);
+    buck.permute(0);
+
+    // not reached: the permutation exits once the retries are exhausted
+    printf("permutation completed with Z = 2\n");
+    return 0;
+}
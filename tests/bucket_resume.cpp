@@ -0,0 +1,106 @@
+/********************************************************************
+ A bucket capacity below bucket::capacity overflows in about half of
+ the runs. A run that overflows is repeated with a new permutation and
+ writes a checkpoint of its first level (the only level 0 checkpoint of
+ a run). The run is killed after the repeat and resumed, which must
+ produce the permutation of the repeated run.
+ *********************************************************************/
+
+#include <cstdio>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "../utils/server.h"
+#include "../headers/bucket.h"
+
+#define CHECKPOINT_FILE "bucket_resume.ckpt"
+#define CAPACITY 40
+#define ATTEMPTS 20
+
+static void create_input(uint32_t size)
+{
+    server cloud(64);
+    cloud.create_array(0, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud.put(0, i, new element(i, 0, nullptr));
+    }
+}
+
+/**
+ @return true if the checkpoint of a repeated run has been written
+ */
+static bool repeated(uint32_t size)
+{
+    checkpoint_log log(CHECKPOINT_FILE);
+    checkpoint *cp = log.load(BUCKET_CHECKPOINT, size);
+    if(cp == nullptr) {
+        return false;
+    }
+    cp->read<unsigned>();
+    bool first_level = cp->read<uint32_t>() == 0;
+    delete cp;
+    return first_level;
+}
+
+/**
+ Runs a checkpointed permutation in a child process and kills it once it has been repeated.
+ @return 1 if the run was repeated and resumed correctly, 0 if it was not repeated, -1 on errors
+ */
+static int interrupt(uint32_t size)
+{
+    unlink(CHECKPOINT_FILE);
+    create_input(size);
+    pid_t child = fork();
+    if(child == 0) {
+        server cloud(64);
+        cloud.open_array(0, size);
+        bucket buck(&cloud, size, CAPACITY, 2, 1);
+        buck.enable_checkpoints(CHECKPOINT_FILE);
+        buck.permute(0);
+        _exit(0);
+    }
+    int status;
+    while(!repeated(size)) {
+        if(waitpid(child, &status, WNOHANG) == child) {
+            // the first run did not overflow
+            return 0;
+        }
+        usleep(100);
+    }
+    usleep(20000);
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+    if(WIFEXITED(status)) {
+        // the repeated run completed before it was killed
+        return 0;
+    }
+
+    server cloud(64);
+    bucket buck(&cloud, size, CAPACITY, 2, 1);
+    buck.enable_checkpoints(CHECKPOINT_FILE);
+    name_t output = buck.resume(0);
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        element *e = cloud.get(output, i);
+        if(e->key != (uint32_t) buck.get_inv_pi(i)) {
+            errors++;
+        }
+        delete e;
+    }
+    printf("resumed a repeated run: %u misplaced elements\n", errors);
+    return (errors == 0) ? 1 : -1;
+}
+
+int main()
+{
+    uint32_t size = 100000;
+    int result = 0;
+    for (uint32_t attempt = 0; attempt < ATTEMPTS && result == 0; ++attempt) {
+        result = interrupt(size);
+    }
+    unlink(CHECKPOINT_FILE);
+    if(result == 0) {
+        printf("no run was repeated in %u attempts\n", ATTEMPTS);
+    }
+    return (result == 1) ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+/********************************************************************
+ The radix-k network permutes arrays whose length is not a power of
+ k. Every element of the output must be at its position under pi.
+ *********************************************************************/
+
+#include <cstdio>
+#include "../utils/server.h"
+#include "../headers/kwaksman.h"
+
+static void create_input(server *cloud, name_t name, uint32_t size)
+{
+    cloud->create_array(name, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud->put(name, i, new element(i, 0, nullptr));
+    }
+}
+
+int main()
+{
+    auto *cloud = new server(64);
+    uint32_t errors = 0;
+    for (uint32_t k : {2u, 4u, 16u}) {
+        for (uint32_t size : {5u, 17u, 100u, 1000u, 4097u, 20001u}) {
+            create_input(cloud, 0, size);
+            kwaksman network(cloud, size, k);
+            name_t output = network.permute(0);
+            uint32_t misplaced = 0;
+            for (uint32_t i = 0; i < size; ++i) {
+                element *e = cloud->get(output, i);
+                if(e->key != (uint32_t) network.get_inv_pi(i)) {
+                    misplaced++;
+                }
+                delete e;
+            }
+            cloud->delete_array(output);
+            if(misplaced > 0) {
+                printf("k = %u, n = %u: %u misplaced elements\n", k, size, misplaced);
+            }
+            errors += misplaced;
+        }
+    }
+    delete cloud;
+    return (errors == 0) ? 0 : 1;
+}
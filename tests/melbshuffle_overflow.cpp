@@ -0,0 +1,29 @@
+/********************************************************************
+ A load parameter of 1 leaves no room above the expected load of a
+ bin, so the bins overflow in every run of a shuffle pass. The
+ permutation must stop after MELBSHUFFLE_MAX_RETRIES repeated runs and
+ report the error (checked by the output of the test).
+ *********************************************************************/
+
+#include <cstdio>
+#include "../utils/server.h"
+#include "../headers/melbshuffle.h"
+
+int main()
+{
+    uint32_t size = 10000;
+    auto *cloud = new server(64);
+    cloud->create_array(0, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud->put(0, i, new element(i, 0, nullptr));
+    }
+
+    melb_options options;
+    options.p = 1;
+    melbshuffle melb(cloud, size, options, 1);
+    melb.permute(0);
+
+    // not reached: the permutation exits once the retries are exhausted
+    printf("permutation completed with p = 1\n");
+    return 0;
+}
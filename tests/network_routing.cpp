@@ -0,0 +1,97 @@
+/********************************************************************
+ A configuration of a Waksman network is exported, serialized and
+ loaded, and routed by a router. Routing several columns applies pi to
+ each of them, routing the inverse restores their order, and
+ waksman::unpermute restores the output of permute.
+ *********************************************************************/
+
+#include <cstdio>
+#include <sstream>
+#include "../utils/server.h"
+#include "../utils/network_config.h"
+#include "../headers/waksman.h"
+#include "../headers/router.h"
+
+// the temporary arrays of the network are name+1 and name+2, so the columns are placed after them
+#define FIRST_COLUMN 16
+
+static void create_input(server *cloud, name_t name, uint32_t size, uint32_t first)
+{
+    cloud->create_array(name, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud->put(name, i, new element(first + i, 0, nullptr));
+    }
+}
+
+/**
+ @param expected The key expected at each position, offset by first
+ @return the number of misplaced elements of the array
+ */
+template<typename F>
+static uint32_t count_errors(server *cloud, name_t name, uint32_t size, uint32_t first, F expected)
+{
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        element *e = cloud->get(name, i);
+        if(e->key != first + expected(i)) {
+            errors++;
+        }
+        delete e;
+    }
+    return errors;
+}
+
+static uint32_t check(server *cloud, uint32_t size)
+{
+    uint32_t errors = 0;
+    create_input(cloud, 0, size, 0);
+    waksman network(cloud, size, 1);
+    network.retain_configuration();
+    name_t output = network.permute(0);
+    auto pi_inv = [&network](uint32_t i) { return (uint32_t) network.get_inv_pi(i); };
+    auto identity = [](uint32_t i) { return i; };
+
+    // the serialized configuration is routed through two columns together
+    std::stringstream stream;
+    network.get_config()->save(stream);
+    network_config *config = network_config::load(stream);
+    if(config == nullptr || config->get_length() != size) {
+        printf("n = %u: the configuration was not loaded\n", size);
+        return 1;
+    }
+    create_input(cloud, FIRST_COLUMN, size, 0);
+    create_input(cloud, FIRST_COLUMN + 1, size, size);
+    router columns(cloud, config);
+    columns.route({FIRST_COLUMN, FIRST_COLUMN + 1});
+    errors += count_errors(cloud, FIRST_COLUMN, size, 0, pi_inv);
+    errors += count_errors(cloud, FIRST_COLUMN + 1, size, size, pi_inv);
+
+    router reverse(cloud, config);
+    reverse.route_inverse({FIRST_COLUMN, FIRST_COLUMN + 1});
+    errors += count_errors(cloud, FIRST_COLUMN, size, 0, identity);
+    errors += count_errors(cloud, FIRST_COLUMN + 1, size, size, identity);
+    cloud->delete_array(FIRST_COLUMN);
+    cloud->delete_array(FIRST_COLUMN + 1);
+    delete config;
+
+    // the retained configuration restores the output of permute
+    name_t restored = network.unpermute(output);
+    errors += count_errors(cloud, restored, size, 0, identity);
+    cloud->delete_array(restored);
+
+    if(errors > 0) {
+        printf("n = %u: %u misplaced elements\n", size, errors);
+    }
+    return errors;
+}
+
+int main()
+{
+    auto *cloud = new server(64);
+    uint32_t errors = 0;
+    for (uint32_t size : {5u, 13u, 100u, 129u, 1025u, 20001u}) {
+        errors += check(cloud, size);
+    }
+    delete cloud;
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+/********************************************************************
+ The odd-even merge and bitonic networks permute and sort arrays whose
+ length is not a power of two, with small chunks in client memory and
+ several threads. A permutation must place every element at its
+ position under pi and clear the tags; a sort must order the elements
+ by their tags and keep them.
+ *********************************************************************/
+
+#include <cstdio>
+#include <vector>
+#include "../utils/server.h"
+#include "../headers/oddeven.h"
+#include "../headers/bitonic.h"
+
+#define MEMORY 8
+#define THREADS 4
+
+/**
+ @param tagged If true, each element is given a tag (with repeated tags) to be sorted by
+ */
+static void create_input(server *cloud, uint32_t size, bool tagged)
+{
+    cloud->create_array(0, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        tag_t tag = tagged ? (i * 2654435761u) % (size / 2 + 1) : 0;
+        cloud->put(0, i, new element(i, tag, nullptr));
+    }
+}
+
+template<typename network>
+static uint32_t check_permute(server *cloud, uint32_t size, char const *name)
+{
+    create_input(cloud, size, false);
+    network sorter(cloud, size, MEMORY, THREADS);
+    name_t output = sorter.permute(0);
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        element *e = cloud->get(output, i);
+        if(e->key != (uint32_t) sorter.get_inv_pi(i) || e->aux != 0) {
+            errors++;
+        }
+        delete e;
+    }
+    cloud->delete_array(output);
+    if(errors > 0) {
+        printf("%s permute, n = %u: %u misplaced or tagged elements\n", name, size, errors);
+    }
+    return errors;
+}
+
+template<typename network>
+static uint32_t check_sort(server *cloud, uint32_t size, char const *name)
+{
+    create_input(cloud, size, true);
+    network sorter(cloud, size, MEMORY, THREADS);
+    name_t output = sorter.sort(0);
+    uint32_t errors = 0;
+    std::vector<bool> seen(size, false);
+    tag_t previous = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        element *e = cloud->get(output, i);
+        tag_t tag = (e->key * 2654435761u) % (size / 2 + 1);
+        if(e->key >= size || seen[e->key] || e->aux != tag || e->aux < previous) {
+            errors++;
+        } else {
+            seen[e->key] = true;
+        }
+        previous = e->aux;
+        delete e;
+    }
+    cloud->delete_array(output);
+    if(errors > 0) {
+        printf("%s sort, n = %u: %u misplaced elements\n", name, size, errors);
+    }
+    return errors;
+}
+
+int main()
+{
+    auto *cloud = new server(64);
+    uint32_t errors = 0;
+    for (uint32_t size : {3u, 5u, 13u, 100u, 1000u, 3001u}) {
+        errors += check_permute<oddeven>(cloud, size, "oddeven");
+        errors += check_permute<bitonic>(cloud, size, "bitonic");
+        errors += check_sort<oddeven>(cloud, size, "oddeven");
+        errors += check_sort<bitonic>(cloud, size, "bitonic");
+    }
+    delete cloud;
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+/********************************************************************
+ A checkpointed permutation is killed part way through and resumed
+ from its last checkpoint, which must produce the permutation of the
+ interrupted run. The test is built with small checkpointed subtrees,
+ so runs are interrupted in both phases and in subtrees of the
+ configuration phase.
+ *********************************************************************/
+
+#include <cstdio>
+#include <chrono>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../utils/server.h"
+#include "../headers/waksman.h"
+
+#define CHECKPOINT_FILE "waksman_resume.ckpt"
+
+static void create_input(uint32_t size)
+{
+    server cloud(64);
+    cloud.create_array(0, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        cloud.put(0, i, new element(i, 0, nullptr));
+    }
+}
+
+static uint32_t count_errors(server *cloud, waksman *network, name_t output, uint32_t size)
+{
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        element *e = cloud->get(output, i);
+        if(e->key != (uint32_t) network->get_inv_pi(i)) {
+            errors++;
+        }
+        delete e;
+    }
+    return errors;
+}
+
+static bool checkpoint_written()
+{
+    struct stat info{};
+    return stat(CHECKPOINT_FILE, &info) == 0 && info.st_size > 0;
+}
+
+/**
+ Runs a checkpointed permutation in a child process and kills it once the first checkpoint is on disk
+  and the delay has passed. The run is then resumed.
+ @return the number of misplaced elements, or 0 if the run completed before it was killed
+ */
+static uint32_t interrupt(uint32_t size, std::chrono::microseconds delay)
+{
+    unlink(CHECKPOINT_FILE);
+    create_input(size);
+    pid_t child = fork();
+    if(child == 0) {
+        server cloud(64);
+        cloud.open_array(0, size);
+        waksman network(&cloud, size, 1);
+        network.enable_checkpoints(CHECKPOINT_FILE, 0);
+        network.permute(0);
+        _exit(0);
+    }
+    while(!checkpoint_written()) {
+        usleep(100);
+    }
+    usleep(delay.count());
+    kill(child, SIGKILL);
+    int status;
+    waitpid(child, &status, 0);
+    if(WIFEXITED(status)) {
+        printf("n = %u: the run completed before it was killed\n", size);
+        return 0;
+    }
+
+    server cloud(64);
+    waksman network(&cloud, size, 1);
+    network.enable_checkpoints(CHECKPOINT_FILE, 0);
+    name_t output = network.resume(0);
+    uint32_t errors = count_errors(&cloud, &network, output, size);
+    printf("n = %u: resumed after %ld us, %u misplaced elements\n", size, (long) delay.count(), errors);
+    return errors;
+}
+
+int main()
+{
+    uint32_t errors = 0;
+    for (uint32_t size : {20001u, 16384u}) {
+        // time an uninterrupted run to spread the interruptions over the run
+        std::chrono::microseconds duration{};
+        {
+            unlink(CHECKPOINT_FILE);
+            create_input(size);
+            server cloud(64);
+            cloud.open_array(0, size);
+            waksman network(&cloud, size, 1);
+            network.enable_checkpoints(CHECKPOINT_FILE, 0);
+            auto start = std::chrono::steady_clock::now();
+            name_t output = network.permute(0);
+            auto end = std::chrono::steady_clock::now();
+            duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+            errors += count_errors(&cloud, &network, output, size);
+        }
+
+        for (uint32_t part = 0; part < 4; ++part) {
+            errors += interrupt(size, duration * part / 5);
+        }
+    }
+    unlink(CHECKPOINT_FILE);
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+/********************************************************************
+ Permutation of small blocks of records in client memory.
+
+ A block of up to 64 words is permuted by a Benes network of conditional
+ swaps. The switches of the network are set for the permutation of the
+ block in client memory, and each layer of switches is a mask of bits.
+ Between the layers the words move by perfect shuffles, whose patterns
+ only depend on the block size and are built at compile time. The
+ shuffles use AVX-512 vpermt2q (selecting from two table registers at a
+ time) or AVX2 vpermd (moving the two 32-bit halves of each word), and
+ the switches are applied with masked blends. Blocks of fewer than eight
+ words, or builds without AVX2, use the scalar loops.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_BLOCK_PERMUTE_H
+#define MY_PROJECT_BLOCK_PERMUTE_H
+
+#include <cstdint>
+#include <utility>
+#include <cassert>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// the largest block that is permuted in registers
+#define MAX_PERMUTE_BLOCK 64
+#define MAX_PERMUTE_LOG 6
+// number of layers of switches of the Benes network of the largest block
+#define MAX_PERMUTE_LAYERS (2*MAX_PERMUTE_LOG - 1)
+
+/**
+    Scalar permutation of a block.
+    @param in The words of the block
+    @param out Output buffer (out[j] = in[index[j]])
+    @param index The input position of each output position
+    @param size The number of words in the block
+*/
+inline void permute_block_scalar(uint64_t const *in, uint64_t *out, uint32_t const *index, uint32_t size)
+{
+    for (uint32_t j = 0; j < size; ++j) {
+        out[j] = in[index[j]];
+    }
+}
+
+/**
+    Permutes a block of N words in registers. N is a multiple of 8 and at most MAX_PERMUTE_BLOCK.
+    @param in The words of the block
+    @param out Output buffer (out[j] = in[index[j]])
+    @param index The input position of each output position
+*/
+template<uint32_t N>
+inline void permute_block(uint64_t const *in, uint64_t *out, uint32_t const *index)
+{
+    static_assert(N % 8 == 0 && N <= MAX_PERMUTE_BLOCK, "unsupported block size");
+#if defined(__AVX512F__)
+    // the block is held in N/8 registers; vpermt2q selects from a pair of registers (16 words)
+    __m512i table[N/8];
+    for (uint32_t t = 0; t < N/8; ++t) {
+        table[t] = _mm512_loadu_si512(in + 8*t);
+    }
+    for (uint32_t c = 0; c < N; c += 8) {
+        __m512i idx = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i const*) (index + c)));
+        __m512i acc;
+        if(N == 8) {
+            acc = _mm512_permutexvar_epi64(idx, table[0]);
+        } else {
+            acc = _mm512_setzero_si512();
+            __m512i pair = _mm512_srli_epi64(idx, 4);
+            for (uint32_t p = 0; p < N/16; ++p) {
+                __m512i r = _mm512_permutex2var_epi64(table[2*p], idx, table[(2*p+1) % (N/8)]);
+                __mmask8 m = _mm512_cmpeq_epi64_mask(pair, _mm512_set1_epi64(p));
+                acc = _mm512_mask_mov_epi64(acc, m, r);
+            }
+        }
+        _mm512_storeu_si512(out + c, acc);
+    }
+#elif defined(__AVX2__)
+    // the block is held in N/4 registers; vpermd moves both halves of a word within a register
+    __m256i table[N/4];
+    for (uint32_t t = 0; t < N/4; ++t) {
+        table[t] = _mm256_loadu_si256((__m256i const*) (in + 4*t));
+    }
+    const __m256i three = _mm256_set1_epi64x(3), one = _mm256_set1_epi64x(1);
+    for (uint32_t c = 0; c < N; c += 4) {
+        __m256i idx = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i const*) (index + c)));
+        // 32-bit lanes (2i, 2i+1) hold word i of a register
+        __m256i low = _mm256_slli_epi64(_mm256_and_si256(idx, three), 1);
+        __m256i lanes = _mm256_or_si256(low, _mm256_slli_epi64(_mm256_add_epi64(low, one), 32));
+        __m256i reg = _mm256_srli_epi64(idx, 2);
+        __m256i acc = _mm256_setzero_si256();
+        for (uint32_t t = 0; t < N/4; ++t) {
+            __m256i r = _mm256_permutevar8x32_epi32(table[t], lanes);
+            __m256i m = _mm256_cmpeq_epi64(reg, _mm256_set1_epi64x(t));
+            acc = _mm256_blendv_epi8(acc, r, m);
+        }
+        _mm256_storeu_si256((__m256i*) (out + c), acc);
+    }
+#else
+    permute_block_scalar(in, out, index, N);
+#endif
+}
+
+/**
+    Perfect shuffles of a block of N words (N is a power of two). Layer l moves the words within aligned
+     groups of N >> l words. The unshuffle sends the even positions of a group to its first half and the odd
+     positions to its second half (the inputs of the two subnetworks), and the shuffle is its inverse.
+*/
+template<uint32_t N>
+struct benes_shuffles
+{
+    uint32_t unshuffle[MAX_PERMUTE_LOG][N];
+    uint32_t shuffle[MAX_PERMUTE_LOG][N];
+
+    constexpr benes_shuffles():
+            unshuffle(),
+            shuffle()
+    {
+        for (uint32_t l = 0; (N >> l) > 2; ++l) {
+            uint32_t half = (N >> l) / 2;
+            for (uint32_t group = 0; group < N; group += 2*half) {
+                for (uint32_t i = 0; i < half; ++i) {
+                    unshuffle[l][group + i] = group + 2*i;
+                    unshuffle[l][group + half + i] = group + 2*i + 1;
+                    shuffle[l][group + 2*i] = group + i;
+                    shuffle[l][group + 2*i + 1] = group + half + i;
+                }
+            }
+        }
+    }
+};
+
+/**
+    Sets the switches of the Benes network of a group of a block (looping algorithm). The entry switch i
+     of a group sends input 2i to the first subnetwork (0) or to the second (1), and the exit switch j
+     takes output 2j from the first subnetwork (0) or from the second (1).
+    @param dest The output position of each input of the group (modified)
+    @param size The number of words in the group
+    @param base The position of the group in the block
+    @param layer The layer of the entry switches of the group
+    @param last The last layer of the network
+    @param masks Switch bits of each layer (bit i of a layer is the switch of words 2i and 2i+1)
+*/
+inline void route_benes(uint32_t *dest, uint32_t size, uint32_t base, uint32_t layer, uint32_t last,
+        uint64_t *masks)
+{
+    if(size == 2) {
+        masks[layer] |= (uint64_t) (dest[0] & 1u) << (base / 2);
+        return;
+    }
+    uint32_t half = size / 2;
+    uint32_t source[MAX_PERMUTE_BLOCK], sub[MAX_PERMUTE_BLOCK];
+    // 0 or 1 once the input is assigned to a subnetwork
+    uint8_t side[MAX_PERMUTE_BLOCK];
+    for (uint32_t i = 0; i < size; ++i) {
+        source[dest[i]] = i;
+        side[i] = 2;
+    }
+    for (uint32_t start = 0; start < size; start += 2) {
+        // follow the loop of constraints from an unassigned switch
+        uint32_t i = start;
+        while(side[i] == 2) {
+            side[i] = 0;
+            side[i ^ 1u] = 1;
+            // the output next to the output of the partner comes from the first subnetwork
+            i = source[dest[i ^ 1u] ^ 1u];
+        }
+    }
+    for (uint32_t i = 0; i < half; ++i) {
+        // entry switch i swaps if input 2i goes to the second subnetwork
+        uint32_t top = 2*i + side[2*i];
+        masks[layer] |= (uint64_t) side[2*i] << (base/2 + i);
+        // exit switch i swaps if output 2i comes from the second subnetwork
+        masks[last - layer] |= (uint64_t) side[source[2*i]] << (base/2 + i);
+        // the subnetworks route the elements to the exit switches of their outputs
+        sub[i] = dest[top] / 2;
+        sub[half + i] = dest[top ^ 1u] / 2;
+    }
+    route_benes(sub, half, base, layer + 1, last, masks);
+    route_benes(sub + half, half, base + half, layer + 1, last, masks);
+}
+
+template<uint32_t N>
+constexpr benes_shuffles<N> benes_tables{};
+
+/**
+    Applies a layer of switches to a block of N words.
+    @param words The words of the block
+    @param switches Bit i swaps words 2i and 2i+1
+*/
+template<uint32_t N>
+inline void swap_pairs(uint64_t *words, uint64_t switches)
+{
+#if defined(__AVX512F__)
+    if(N % 8 == 0) {
+        for (uint32_t t = 0; t < N/8; ++t) {
+            __m512i x = _mm512_loadu_si512(words + 8*t);
+            // the four switches of a register select both words of their pair
+            uint32_t bits = (switches >> 4*t) & 0xfu;
+            bits = (bits | (bits << 2u)) & 0x33u;
+            bits = (bits | (bits << 1u)) & 0x55u;
+            x = _mm512_mask_mov_epi64(x, (__mmask8) (bits | (bits << 1u)), _mm512_permutex_epi64(x, 0xb1));
+            _mm512_storeu_si512(words + 8*t, x);
+        }
+        return;
+    }
+#elif defined(__AVX2__)
+    if(N % 4 == 0) {
+        for (uint32_t t = 0; t < N/4; ++t) {
+            __m256i x = _mm256_loadu_si256((__m256i const*) (words + 4*t));
+            int64_t low = -(int64_t) ((switches >> 2*t) & 1u), high = -(int64_t) ((switches >> (2*t + 1)) & 1u);
+            __m256i m = _mm256_set_epi64x(high, high, low, low);
+            x = _mm256_blendv_epi8(x, _mm256_permute4x64_epi64(x, 0xb1), m);
+            _mm256_storeu_si256((__m256i*) (words + 4*t), x);
+        }
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < N/2; ++i) {
+        uint64_t diff = (words[2*i] ^ words[2*i+1]) & -((switches >> i) & 1u);
+        words[2*i] ^= diff;
+        words[2*i+1] ^= diff;
+    }
+}
+
+/**
+    Permutes a block of N words (a power of two) by the Benes network set by route_benes.
+    @param words The words of the block (permuted in place)
+    @param masks The switch bits of each layer
+*/
+template<uint32_t N>
+inline void apply_benes(uint64_t *words, uint64_t const *masks)
+{
+    constexpr uint32_t log_n = __builtin_ctz(N);
+    constexpr uint32_t last = 2*log_n - 2;
+    uint64_t buffer[N];
+    uint64_t *in = words, *out = buffer;
+    auto move = [&in, &out](uint32_t const *index) {
+        if constexpr (N % 8 == 0) {
+            permute_block<N>(in, out, index);
+        } else {
+            permute_block_scalar(in, out, index, N);
+        }
+        std::swap(in, out);
+    };
+    // entry switches, from the whole block down to the pairs in the middle of the network
+    for (uint32_t l = 0; l + 1 < log_n; ++l) {
+        swap_pairs<N>(in, masks[l]);
+        move(benes_tables<N>.unshuffle[l]);
+    }
+    swap_pairs<N>(in, masks[log_n - 1]);
+    // exit switches
+    for (uint32_t l = log_n - 1; l-- > 0;) {
+        move(benes_tables<N>.shuffle[l]);
+        swap_pairs<N>(in, masks[last - l]);
+    }
+}
+
+/**
+    Permutes a block with the Benes network specialised for its size.
+    @param words The words of the block (permuted in place)
+    @param masks The switch bits of each layer (see route_benes)
+    @param size The number of words in the block (a power of two, at least 2)
+*/
+inline void apply_benes(uint64_t *words, uint64_t const *masks, uint32_t size)
+{
+    switch (size) {
+        case 2 :
+            apply_benes<2>(words, masks);
+            break;
+        case 4 :
+            apply_benes<4>(words, masks);
+            break;
+        case 8 :
+            apply_benes<8>(words, masks);
+            break;
+        case 16 :
+            apply_benes<16>(words, masks);
+            break;
+        case 32 :
+            apply_benes<32>(words, masks);
+            break;
+        default :
+            assert(size == 64);
+            apply_benes<64>(words, masks);
+    }
+}
+
+#endif //MY_PROJECT_BLOCK_PERMUTE_H
@@ -0,0 +1,224 @@
+/********************************************************************
+ Checkpoints for long-running permutations.
+
+ A checkpoint records the small amount of client state that is needed
+ to continue an algorithm from one of its natural boundaries (a node or
+ a level of a network, or a phase of a shuffle). The server arrays are
+ kept on disk, so together with the checkpoint they describe the whole
+ run. Checkpoints are written alternately to two fixed slots of the
+ checkpoint file with a single positioned write, so a crash while
+ writing one slot leaves the other slot intact. A checkpoint is only
+ written after the server arrays are flushed to disk, and it is flushed
+ itself before the run moves past it.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_CHECKPOINT_H
+#define MY_PROJECT_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC 0x4b504b43
+// size of a slot of the checkpoint file (header and state)
+#define CHECKPOINT_SLOT 4096
+
+// algorithms that write checkpoints
+enum checkpoint_type : uint32_t {WAKSMAN_CHECKPOINT = 1, BUCKET_CHECKPOINT, MELBSHUFFLE_CHECKPOINT};
+
+class checkpoint
+{
+private:
+    std::string data;
+    size_t cursor;
+
+    friend class checkpoint_log;
+
+public:
+    checkpoint():
+            cursor(0)
+    {}
+
+    template<typename T>
+    void write(T value)
+    {
+        data.append((char*) &value, sizeof(T));
+    }
+
+    template<typename T>
+    T read()
+    {
+        T value;
+        memcpy(&value, data.data() + cursor, sizeof(T));
+        cursor += sizeof(T);
+        return value;
+    }
+
+    template<typename T>
+    void write_array(T const *values, uint32_t count)
+    {
+        write(count);
+        data.append((char*) values, count*sizeof(T));
+    }
+
+    /**
+    Reads an array written by write_array.
+    @param values Output buffer (at least the number of values that were written)
+    @return the number of values
+    */
+    template<typename T>
+    uint32_t read_array(T *values)
+    {
+        auto count = read<uint32_t>();
+        memcpy(values, data.data() + cursor, count*sizeof(T));
+        cursor += count*sizeof(T);
+        return count;
+    }
+};
+
+/**
+    Header of a slot of the checkpoint file
+*/
+struct checkpoint_header
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t length;
+    uint32_t size;
+    // the slot with the larger sequence number holds the latest checkpoint
+    uint64_t sequence;
+    uint64_t checksum;
+};
+
+class checkpoint_log
+{
+private:
+    int fd;
+    // sequence number of the latest checkpoint in the file
+    uint64_t sequence;
+
+    /**
+    FNV-1a hash of the header (without the checksum) and the state of a checkpoint.
+    */
+    static uint64_t checksum(checkpoint_header const& header, char const *data)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](char const *bytes, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                hash = (hash ^ (uint8_t) bytes[i]) * 1099511628211ull;
+            }
+        };
+        mix((char const*) &header, offsetof(checkpoint_header, checksum));
+        mix(data, header.size);
+        return hash;
+    }
+
+    /**
+    Reads a slot of the checkpoint file.
+    @param slot The index of the slot (0 or 1)
+    @param header Output header of the slot
+    @param data Output buffer for the state (CHECKPOINT_SLOT bytes)
+    @return true if the slot holds a complete checkpoint
+    */
+    bool read_slot(uint32_t slot, checkpoint_header *header, char *data)
+    {
+        if(pread(fd, header, sizeof(checkpoint_header), slot*CHECKPOINT_SLOT) != sizeof(checkpoint_header)) {
+            return false;
+        }
+        if(header->magic != CHECKPOINT_MAGIC || header->size > CHECKPOINT_SLOT - sizeof(checkpoint_header)) {
+            return false;
+        }
+        auto count = pread(fd, data, header->size, slot*CHECKPOINT_SLOT + sizeof(checkpoint_header));
+        return count == header->size && header->checksum == checksum(*header, data);
+    }
+
+public:
+    /**
+    Opens the checkpoint file (the file is created if it does not exist).
+    @param filename The name of the checkpoint file
+    */
+    explicit checkpoint_log(std::string const& filename):
+            sequence(0)
+    {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        assert(fd >= 0);
+        // later checkpoints must supersede the checkpoints of earlier runs
+        checkpoint_header header{};
+        char data[CHECKPOINT_SLOT];
+        for (uint32_t slot = 0; slot < 2; ++slot) {
+            if(read_slot(slot, &header, data)) {
+                sequence = std::max(sequence, header.sequence);
+            }
+        }
+    }
+
+    ~checkpoint_log()
+    {
+        close(fd);
+    }
+
+    /**
+    Writes a checkpoint to the slot that does not hold the latest checkpoint. The checkpoint is on
+     disk when the function returns.
+    @param cp The state of the run
+    @param type The algorithm that wrote the checkpoint
+    @param length The length of the permuted array
+    */
+    void save(checkpoint const& cp, uint32_t type, uint32_t length)
+    {
+        char slot[CHECKPOINT_SLOT];
+        checkpoint_header header{CHECKPOINT_MAGIC, type, length, (uint32_t) cp.data.size(), ++sequence, 0};
+        assert(header.size <= CHECKPOINT_SLOT - sizeof(checkpoint_header));
+        header.checksum = checksum(header, cp.data.data());
+        memcpy(slot, &header, sizeof(header));
+        memcpy(slot + sizeof(header), cp.data.data(), header.size);
+        auto count = pwrite(fd, slot, sizeof(header) + header.size, (sequence & 1u)*CHECKPOINT_SLOT);
+        assert(count == (ssize_t) (sizeof(header) + header.size));
+        (void) count;
+        // the run may overwrite the arrays of the previous checkpoint once this one is on disk
+        auto status = fdatasync(fd);
+        assert(status == 0);
+        (void) status;
+    }
+
+    /**
+    Reads the latest checkpoint.
+    @param type The algorithm that is resumed
+    @param length The length of the permuted array
+    @return the checkpoint, or nullptr if there is no checkpoint for the algorithm and length
+    */
+    checkpoint *load(uint32_t type, uint32_t length)
+    {
+        checkpoint_header header{}, latest{};
+        char data[CHECKPOINT_SLOT];
+        auto cp = new checkpoint();
+        for (uint32_t slot = 0; slot < 2; ++slot) {
+            if(read_slot(slot, &header, data) && header.sequence > latest.sequence) {
+                latest = header;
+                cp->data.assign(data, header.size);
+            }
+        }
+        if(latest.magic != CHECKPOINT_MAGIC || latest.type != type || latest.length != length) {
+            delete cp;
+            return nullptr;
+        }
+        return cp;
+    }
+
+    /**
+    Removes the checkpoints of a completed run.
+    */
+    void clear()
+    {
+        auto status = ftruncate(fd, 0);
+        assert(status == 0);
+        (void) status;
+    }
+};
+
+#endif //MY_PROJECT_CHECKPOINT_H
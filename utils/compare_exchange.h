@@ -0,0 +1,174 @@
+/********************************************************************
+ Branch-free compare-exchange stages of sorting networks in client
+ memory.
+
+ The networks sort 64-bit words that pack a sort tag in the high half
+ and the position of the element in client memory in the low half, so
+ comparing words compares tags. Every comparator is ascending: the
+ bitonic network uses the variant that reverses the second half of each
+ merge, so a network on n elements is the network on the next power of
+ two with virtual maximal words at the end. A stage is a set of runs of
+ comparators with a common stride. A run is applied with unsigned min
+ and max (AVX-512) or a signed comparison of bias-flipped words (AVX2)
+ and blends, so it executes the same instructions for any data. Runs
+ shorter than a register use the scalar kernel, which swaps with a mask
+ instead of a branch.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_COMPARE_EXCHANGE_H
+#define MY_PROJECT_COMPARE_EXCHANGE_H
+
+#include <cstdint>
+#include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// default number of elements that the client holds in memory for a sorting network
+#ifndef SORT_MEMORY
+#define SORT_MEMORY (1u << 16)
+#endif
+
+// a word that is larger than every packed word (virtual elements beyond the end of the array)
+#define VIRTUAL_WORD UINT64_MAX
+
+/**
+    Packs a sort tag and a position into a word that compares by tag.
+    @param tag The sort tag
+    @param position The position of the element in client memory
+*/
+inline uint64_t pack_tag(uint32_t tag, uint32_t position)
+{
+    return ((uint64_t) tag << 32) | position;
+}
+
+/**
+    @param word A packed word
+    @return the position of the element in client memory
+*/
+inline uint32_t packed_position(uint64_t word)
+{
+    return (uint32_t) word;
+}
+
+/**
+    Scalar ascending compare-exchange of two words.
+*/
+inline void compare_exchange(uint64_t *a, uint64_t *b)
+{
+    uint64_t swap = 0 - (uint64_t) (*a > *b);
+    uint64_t diff = (*a ^ *b) & swap;
+    *a ^= diff;
+    *b ^= diff;
+}
+
+/**
+    Applies the comparators (k, k + stride) for k in [lo, lo + length).
+    @param words The packed words
+    @param lo The first index of the run
+    @param length The number of comparators
+    @param stride The distance between the words of a comparator
+*/
+inline void compare_exchange_run(uint64_t *words, uint32_t lo, uint32_t length, uint32_t stride)
+{
+    uint32_t k = lo, end = lo + length;
+#if defined(__AVX512F__)
+    for (; k + 8 <= end; k += 8) {
+        __m512i a = _mm512_loadu_si512(words + k);
+        __m512i b = _mm512_loadu_si512(words + k + stride);
+        _mm512_storeu_si512(words + k, _mm512_min_epu64(a, b));
+        _mm512_storeu_si512(words + k + stride, _mm512_max_epu64(a, b));
+    }
+#elif defined(__AVX2__)
+    // AVX2 compares signed words, so the sign bit is flipped first
+    const __m256i bias = _mm256_set1_epi64x((long long) (1ull << 63));
+    for (; k + 4 <= end; k += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i const*) (words + k));
+        __m256i b = _mm256_loadu_si256((__m256i const*) (words + k + stride));
+        __m256i swap = _mm256_cmpgt_epi64(_mm256_xor_si256(a, bias), _mm256_xor_si256(b, bias));
+        _mm256_storeu_si256((__m256i*) (words + k), _mm256_blendv_epi8(a, b, swap));
+        _mm256_storeu_si256((__m256i*) (words + k + stride), _mm256_blendv_epi8(b, a, swap));
+    }
+#endif
+    for (; k < end; ++k) {
+        compare_exchange(words + k, words + k + stride);
+    }
+}
+
+/**
+    Applies the comparators (lo + t, hi - t) for t in [0, length).
+    @param words The packed words
+    @param lo The first index of the lower half
+    @param hi The last index of the upper half
+    @param length The number of comparators
+*/
+inline void compare_exchange_reversed(uint64_t *words, uint32_t lo, uint32_t hi, uint32_t length)
+{
+    uint32_t t = 0;
+#if defined(__AVX512F__)
+    const __m512i reverse = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    for (; t + 8 <= length; t += 8) {
+        __m512i a = _mm512_loadu_si512(words + lo + t);
+        __m512i b = _mm512_permutexvar_epi64(reverse, _mm512_loadu_si512(words + hi - t - 7));
+        _mm512_storeu_si512(words + lo + t, _mm512_min_epu64(a, b));
+        _mm512_storeu_si512(words + hi - t - 7, _mm512_permutexvar_epi64(reverse, _mm512_max_epu64(a, b)));
+    }
+#elif defined(__AVX2__)
+    const __m256i bias = _mm256_set1_epi64x((long long) (1ull << 63));
+    for (; t + 4 <= length; t += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i const*) (words + lo + t));
+        __m256i b = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i const*) (words + hi - t - 3)), 0x1b);
+        __m256i swap = _mm256_cmpgt_epi64(_mm256_xor_si256(a, bias), _mm256_xor_si256(b, bias));
+        _mm256_storeu_si256((__m256i*) (words + lo + t), _mm256_blendv_epi8(a, b, swap));
+        _mm256_storeu_si256((__m256i*) (words + hi - t - 3), _mm256_permute4x64_epi64(_mm256_blendv_epi8(b, a, swap), 0x1b));
+    }
+#endif
+    for (; t < length; ++t) {
+        compare_exchange(words + lo + t, words + hi - t);
+    }
+}
+
+/**
+    Applies the first stage of a bitonic merge: the second half of each block is compared in reverse.
+    @param words The packed words
+    @param count The number of words (a multiple of i)
+    @param i The size of the merge
+*/
+inline void bitonic_flip_stage(uint64_t *words, uint32_t count, uint32_t i)
+{
+    for (uint32_t base = 0; base < count; base += i) {
+        compare_exchange_reversed(words, base, base + i - 1, i/2);
+    }
+}
+
+/**
+    Applies a half-cleaner stage of a bitonic merge.
+    @param words The packed words
+    @param count The number of words (a multiple of 2j)
+    @param j The stride of the stage
+*/
+inline void bitonic_half_stage(uint64_t *words, uint32_t count, uint32_t j)
+{
+    for (uint32_t base = 0; base < count; base += 2*j) {
+        compare_exchange_run(words, base, j, j);
+    }
+}
+
+/**
+    Applies a stage of Batcher's odd-even merge sort. The comparators (a, a + k) of a run either
+     all belong to one merge of size 2p or all cross two merges, which are not compared.
+    @param words The packed words
+    @param count The number of words (a multiple of 2p)
+    @param p Half the size of the merges
+    @param k The stride of the stage
+*/
+inline void oddeven_stage(uint64_t *words, uint32_t count, uint32_t p, uint32_t k)
+{
+    for (uint32_t base = k % p; base + k < count; base += 2*k) {
+        if(base / (2*p) == (base + k) / (2*p)) {
+            compare_exchange_run(words, base, std::min(k, count - base - k), k);
+        }
+    }
+}
+
+#endif //MY_PROJECT_COMPARE_EXCHANGE_H
@@ -0,0 +1,173 @@
+/********************************************************************
+ Serializable switch configuration of a Waksman network.
+
+ The configuration stores the entry and exit switch settings of every
+ node of the permutation tree, and the local permutation of every leaf.
+ Settings are packed one bit per switch and grouped by level (nodes of
+ a level appear from left to right), so a level of the network can be
+ routed with a single sequential scan of its settings.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_NETWORK_CONFIG_H
+#define MY_PROJECT_NETWORK_CONFIG_H
+
+#include <cstdint>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#define CONFIG_MAGIC 0x4e534b57
+
+/**
+    A growable sequence of bits packed into 64-bit words.
+*/
+struct bit_stream
+{
+    std::vector<uint64_t> words;
+    uint64_t length = 0;
+
+    void push(bool bit)
+    {
+        if((length & 63u) == 0) {
+            words.push_back(0);
+        }
+        words.back() |= (uint64_t) bit << (length & 63u);
+        length++;
+    }
+
+    bool at(uint64_t index) const
+    {
+        return (words[index >> 6u] >> (index & 63u)) & 1u;
+    }
+
+    void save(std::ostream &out) const
+    {
+        out.write((char*) &length, sizeof(length));
+        out.write((char*) words.data(), words.size()*sizeof(uint64_t));
+    }
+
+    void load(std::istream &in)
+    {
+        in.read((char*) &length, sizeof(length));
+        words.assign((length + 63) / 64, 0);
+        in.read((char*) words.data(), words.size()*sizeof(uint64_t));
+    }
+};
+
+class network_config
+{
+private:
+    uint32_t length;
+    uint32_t leaf_size;
+    // entry and exit switch settings of each level of the permutation tree (root is level 0)
+    std::vector<bit_stream> entry;
+    std::vector<bit_stream> exit;
+    // local permutation values of the leaves (two bits per value)
+    bit_stream leaves;
+
+public:
+    explicit network_config(uint32_t length, uint32_t leaf_size):
+            length(length),
+            leaf_size(leaf_size)
+    {}
+
+    /**
+    Appends the exterior of a node to the configuration.
+    A node of size s has s/2 entry and s/2 exit switches. The bottom wire of an odd node is not a switch.
+    @param level The level of the node in the permutation tree (root is level 0)
+    @param entry_bits The entry switch settings of the node
+    @param exit_bits The exit switch settings of the node
+    @param count The number of switches to store
+    */
+    void push_node(uint32_t level, std::vector<bool> *entry_bits, std::vector<bool> *exit_bits, uint32_t count)
+    {
+        if(level >= entry.size()) {
+            entry.resize(level+1);
+            exit.resize(level+1);
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            entry[level].push(entry_bits->at(i));
+            exit[level].push(exit_bits->at(i));
+        }
+    }
+
+    /**
+    Appends the next value of a leaf permutation to the configuration.
+    @param value The local permutation value (less than 4)
+    */
+    void push_leaf(uint32_t value)
+    {
+        leaves.push(value & 1u);
+        leaves.push(value & 2u);
+    }
+
+    bool entry_at(uint32_t level, uint64_t index) const { return entry[level].at(index); }
+
+    bool exit_at(uint32_t level, uint64_t index) const { return exit[level].at(index); }
+
+    uint32_t leaf_at(uint64_t index) const
+    {
+        return (uint32_t) leaves.at(2*index) | ((uint32_t) leaves.at(2*index+1) << 1u);
+    }
+
+    uint32_t get_length() const { return length; }
+
+    uint32_t get_leaf_size() const { return leaf_size; }
+
+    /**
+    @return the number of internal levels of the permutation tree
+    */
+    uint32_t num_levels() const { return entry.size(); }
+
+    /**
+    Writes the configuration to a stream (a file or memory buffer).
+    @param out The output stream
+    */
+    void save(std::ostream &out) const
+    {
+        uint32_t header[4] = {CONFIG_MAGIC, length, leaf_size, (uint32_t) entry.size()};
+        out.write((char*) header, sizeof(header));
+        for (uint32_t level = 0; level < entry.size(); ++level) {
+            entry[level].save(out);
+            exit[level].save(out);
+        }
+        leaves.save(out);
+    }
+
+    /**
+    Reads a configuration written by save.
+    @param in The input stream
+    @return the configuration, or nullptr if the stream does not hold a configuration
+    */
+    static network_config *load(std::istream &in)
+    {
+        uint32_t header[4];
+        in.read((char*) header, sizeof(header));
+        if(!in || header[0] != CONFIG_MAGIC) {
+            return nullptr;
+        }
+        auto config = new network_config(header[1], header[2]);
+        config->entry.resize(header[3]);
+        config->exit.resize(header[3]);
+        for (uint32_t level = 0; level < header[3]; ++level) {
+            config->entry[level].load(in);
+            config->exit[level].load(in);
+        }
+        config->leaves.load(in);
+        return config;
+    }
+
+    void save(std::string const& filename) const
+    {
+        std::ofstream out(filename, std::ios::binary);
+        save(out);
+    }
+
+    static network_config *load(std::string const& filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        return load(in);
+    }
+};
+
+#endif //MY_PROJECT_NETWORK_CONFIG_H
@@ -23,6 +23,8 @@ private:
     uint32_t size;
     uint32_t *perm;
     uint32_t *inv_perm;
+    // seed of the shuffle (the permutation is reproducible from its seed)
+    unsigned shuffle_seed;
     //uint32_t mask_left;
     //uint32_t mask_right;
     //uint32_t seed;
@@ -36,24 +38,7 @@ public:
         perm = (uint32_t*) calloc(sizeof(uint32_t), size) ;
         inv_perm = (uint32_t*) calloc(sizeof(uint32_t), size);
 
-        // create the array {0,1,...,size-1}
-        for (int i = 0; i < size; ++i) {
-            perm[i] = i;
-        }
-
-        // shuffle the array
-        unsigned seed = std::chrono::steady_clock::now().time_since_epoch().count();
-        std::shuffle(&perm[0], &perm[size],  std::default_random_engine(seed));
-
-        // create an array with the inverse permutation
-        uint32_t count=0;
-        for (int j = 0; j < size; ++j) {
-            while(perm[count] != j) {
-                count++;
-            }
-            inv_perm[j] = count;
-            count = 0;
-        }
+        set_seed(std::chrono::steady_clock::now().time_since_epoch().count());
         /*
         power = 32-__builtin_clz(size | 1);
         uint32_t mask = (1u << power) - 1;
@@ -122,18 +107,34 @@ public:
     Assigns a new random permutation by randomly shuffling the stored array.
     */
     void new_seed() {
-        unsigned seed = rand();
+        set_seed(rand());
+    }
+
+    /**
+    Assigns the permutation generated by a seed. The same seed always gives the same permutation.
+    @param seed The seed of the shuffle
+    */
+    void set_seed(unsigned seed) {
+        shuffle_seed = seed;
+
+        // create the array {0,1,...,size-1} and shuffle
+        for (uint32_t i = 0; i < size; ++i) {
+            perm[i] = i;
+        }
         std::shuffle(&perm[0], &perm[size],  std::default_random_engine(seed));
 
-        uint32_t count=0;
-        for (int j = 0; j < size; ++j) {
-            while(perm[count] != j) {
-                count++;
-            }
-            inv_perm[j] = count;
-            count = 0;
+        // create an array with the inverse permutation
+        for (uint32_t j = 0; j < size; ++j) {
+            inv_perm[perm[j]] = j;
         }
     }
+
+    /**
+    @return the seed of the current permutation
+    */
+    unsigned get_seed() {
+        return shuffle_seed;
+    }
 };
 
 #endif //MY_PROJECT_PERMUTATION_H
@@ -5,6 +5,8 @@
  items using the interface of the server
 
  Simulation is designed to measure performance in a client-server protocol.
+ Elements are read and written with positioned I/O (pread/pwrite), so
+ several threads can access the arrays of the server concurrently.
 
  Created by William Holland on 1/02/21.
  *********************************************************************/
@@ -12,15 +14,29 @@
 #define MY_PROJECT_SERVER_H
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <algorithm>
 #include <tr1/unordered_map>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define BYTESPERELEM 9
+// an element is stored as its key (4 bytes), its tag (8 bytes) and a line break
+#define BYTESPERELEM 13
 
 typedef uint32_t name_t;
 
+// auxiliary routing tag carried alongside each element
+typedef uint64_t tag_t;
+#define TAG_BITS 64
+
+// key of a dummy element. A record of all-ones bytes is a dummy, so a buffer of dummies is filled by memset
+#define DUMMY_KEY UINT32_MAX
+#define DUMMY_BYTE 0xff
+
 /**
     Structure of elements stored at the server.
     Each element has a key and a value and can store auxiliary information.
@@ -30,10 +46,10 @@ typedef uint32_t name_t;
 struct element
 {
     uint32_t key;
-    uint32_t aux;
+    tag_t aux;
     uint32_t *value;
 
-    explicit element(uint32_t k, uint32_t a, uint32_t *value):
+    explicit element(uint32_t k, tag_t a, uint32_t *value):
             key(k),
             aux(a),
             value(value)
@@ -50,15 +66,24 @@ struct element
 */
 struct disk_array
 {
-    std::ofstream *out;
-    std::ifstream *in;
+    // file descriptor (shared by all threads, every access is positioned)
+    int fd;
     uint32_t length;
 
-    explicit disk_array(std::string const& filename, uint32_t length)
+    explicit disk_array(std::string const& filename, uint32_t length, bool truncate = true)
     {
         this->length = length;
-        out = new std::ofstream(filename, std::ios::binary);
-        in = new std::ifstream(filename, std::ios::binary); // she/him
+        int flags = O_RDWR | O_CREAT;
+        if(truncate) {
+            flags |= O_TRUNC;
+        }
+        fd = open(filename.c_str(), flags, 0644);
+        assert(fd >= 0);
+    }
+
+    ~disk_array()
+    {
+        close(fd);
     }
 };
 
@@ -70,7 +95,7 @@ struct disk_array
 class server
 {
 private:
-    uint32_t num_IO;
+    std::atomic<uint32_t> num_IO;
     uint32_t block_size;
     // map array IDs to arrays on disk
     std::tr1::unordered_map<name_t, disk_array*> table;
@@ -96,6 +121,80 @@ public:
         table[name] = f;
     }
 
+    /**
+    Opens an array that is already stored at the server (for instance by an interrupted run).
+    The contents of the array are kept. If the array does not exist it is created.
+    @param name The identifier for the array
+    @param length The length of the stored array
+    */
+    void open_array(uint32_t name, uint32_t length)
+    {
+        std::string filename = "file" + std::to_string(name) + ".dat";
+        table[name] = new disk_array(filename, length, false);
+    }
+
+    /**
+    Creates an element from a record (the value is allocated in client memory as by get).
+    @param record The record of the element (BYTESPERELEM bytes)
+    @return the element
+    */
+    element *to_element(char const *record)
+    {
+        uint32_t key;
+        tag_t aux;
+        memcpy(&key, record, sizeof(key));
+        memcpy(&aux, record + sizeof(key), sizeof(aux));
+        // Allocate a block of block_size bits in the clients memory
+        // The value is blank and used for simulating client memory
+        auto *value = (uint32_t*) calloc(block_size/32, sizeof(int));
+        return new element(key, aux, value);
+    }
+
+    /**
+    Serialises an element into a record.
+    @param x The element
+    @param record Output buffer (BYTESPERELEM bytes)
+    */
+    static void to_record(element const *x, char *record)
+    {
+        to_record(x->key, x->aux, record);
+    }
+
+    /**
+    Serialises a key and a tag into a record.
+    @param key The key
+    @param aux The tag
+    @param record Output buffer (BYTESPERELEM bytes)
+    */
+    static void to_record(uint32_t key, tag_t aux, char *record)
+    {
+        memcpy(record, &key, sizeof(key));
+        memcpy(record + sizeof(key), &aux, sizeof(aux));
+        record[BYTESPERELEM-1] = '\n';
+    }
+
+    /**
+    @param record A record
+    @return the key of the record
+    */
+    static uint32_t record_key(char const *record)
+    {
+        uint32_t key;
+        memcpy(&key, record, sizeof(key));
+        return key;
+    }
+
+    /**
+    @param record A record
+    @return the tag of the record
+    */
+    static tag_t record_tag(char const *record)
+    {
+        tag_t aux;
+        memcpy(&aux, record + sizeof(uint32_t), sizeof(aux));
+        return aux;
+    }
+
     /**
     Retrieves an element from a specified array and index at the server
     @param name The identifier for the array
@@ -106,25 +205,18 @@ public:
     {
         // count the number of IOs between server and client
         num_IO++;
-        uint64_t output;
-        uint32_t key, aux, *value;
 
-        // get file handler
-        disk_array *array = table[name];
-        std::ifstream *f = array->in;
-
-        // locate element in file and retrieve
-        uint32_t file_idx = index*BYTESPERELEM;
-        f->seekg(file_idx, std::ios::beg);
-        f->read(reinterpret_cast<char*>(&output), sizeof(output));
+        // get file handler (the table is not modified while threads access the server)
+        disk_array *array = table.find(name)->second;
 
-        key = output & (uint64_t) INT32_MAX;
-        aux = (uint32_t) (output >> 32u);
-        // Allocate a block of block_size bits in the clients memory
-        // The value is blank and used for simulating client memory
-        value = (uint32_t*) calloc(block_size/32, sizeof(int));
+        // locate element in file and retrieve (positions that were never written are zero)
+        char record[BYTESPERELEM] = {};
+        uint64_t file_idx = (uint64_t) index*BYTESPERELEM;
+        ssize_t bytes = pread(array->fd, record, BYTESPERELEM - 1, file_idx);
+        assert(bytes >= 0);
+        (void) bytes;
 
-        return new element(key, aux, value);
+        return to_element(record);
     }
 
     /**
@@ -135,22 +227,70 @@ public:
     void put(uint32_t name, uint32_t index, element *x)
     {
         num_IO++;
-        disk_array *array = table[name];
-        std::ostream *f = array->out;
-        uint64_t packet = x->aux;
-        packet <<= 32u;
-        packet |= (uint64_t) x->key;
-
-        // locate index at the sever
-        uint32_t file_idx = index*BYTESPERELEM;
-        f->seekp(file_idx, std::ios::beg);
-        f->write((char*) &packet, sizeof(packet));
-        (*f) << std::endl;
-        f->flush();
+        disk_array *array = table.find(name)->second;
+
+        // serialise the element and write it at its index
+        char record[BYTESPERELEM];
+        to_record(x, record);
+        uint64_t file_idx = (uint64_t) index*BYTESPERELEM;
+        ssize_t bytes = pwrite(array->fd, record, BYTESPERELEM, file_idx);
+        assert(bytes == BYTESPERELEM);
+        (void) bytes;
 
         delete x;
     }
 
+    /**
+    Retrieves consecutive records of an array with one positioned read. Each record counts as an IO.
+     Records beyond the end of the array are not retrieved.
+    @param name The identifier for the array
+    @param index The index of the first record
+    @param count The number of records
+    @param buffer Output buffer (count*BYTESPERELEM bytes)
+    @return the number of records that were retrieved
+    */
+    uint32_t get_records(uint32_t name, uint32_t index, uint32_t count, char *buffer)
+    {
+        disk_array *array = table.find(name)->second;
+        count = (index < array->length) ? std::min(count, array->length - index) : 0;
+        num_IO += count;
+
+        // positions that were never written are zero
+        memset(buffer, 0, (size_t) count*BYTESPERELEM);
+        ssize_t bytes = pread(array->fd, buffer, (size_t) count*BYTESPERELEM, (uint64_t) index*BYTESPERELEM);
+        assert(bytes >= 0);
+        (void) bytes;
+        return count;
+    }
+
+    /**
+    Places consecutive records in an array with one positioned write. Each record counts as an IO.
+    @param name The identifier for the array
+    @param index The index of the first record
+    @param count The number of records
+    @param buffer The records (count*BYTESPERELEM bytes)
+    */
+    void put_records(uint32_t name, uint32_t index, uint32_t count, char const *buffer)
+    {
+        num_IO += count;
+        disk_array *array = table.find(name)->second;
+        ssize_t bytes = pwrite(array->fd, buffer, (size_t) count*BYTESPERELEM, (uint64_t) index*BYTESPERELEM);
+        assert(bytes == (ssize_t) count*BYTESPERELEM);
+        (void) bytes;
+    }
+
+    /**
+    Flushes the writes to all arrays to disk, so that they survive a crash of the machine.
+    */
+    void sync()
+    {
+        for (auto& entry : table) {
+            auto status = fdatasync(entry.second->fd);
+            assert(status == 0);
+            (void) status;
+        }
+    }
+
     /**
     Resets the count of IOs between server and client
     */
@@ -161,6 +301,20 @@ public:
     */
     uint32_t get_IO() { return num_IO;}
 
+    /**
+    Shortens an array. The elements beyond the new length are discarded.
+    @param name The identifier for the array
+    @param length The new length of the array
+    */
+    void truncate_array(name_t name, uint32_t length)
+    {
+        disk_array *array = table.find(name)->second;
+        array->length = std::min(array->length, length);
+        auto status = ftruncate(array->fd, (off_t) array->length*BYTESPERELEM);
+        assert(status == 0);
+        (void) status;
+    }
+
     /**
     Delete an array from the server
     @param i the name of the array to be deleted
@@ -168,8 +322,6 @@ public:
     void delete_array(name_t i)
     {
         disk_array *arr = table[i];
-        arr->out->close();
-        arr->in->close();
         delete arr;
         table.erase(i);
     }
@@ -180,9 +332,9 @@ public:
     @param name The identifier for the array
     @param index The index of the element in the array
     */
-    bool check(name_t name, int index) {
+    bool check(name_t name, uint32_t index) {
         // get file handler
-        disk_array *array = table[name];
+        disk_array *array = table.find(name)->second;
         return index < array->length;
     }
 };
@@ -0,0 +1,130 @@
+/********************************************************************
+ A fixed size pool of worker threads.
+
+ Work is submitted as a range of indices that is split into one chunk
+ for each worker. The caller blocks until every chunk is complete, so
+ consecutive calls to parallel_for are separated by a barrier.
+ *********************************************************************/
+
+#ifndef MY_PROJECT_THREAD_POOL_H
+#define MY_PROJECT_THREAD_POOL_H
+
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+class thread_pool
+{
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable available;
+    std::condition_variable finished;
+    // number of submitted tasks that are not complete
+    uint32_t pending;
+    bool stop;
+
+    void work()
+    {
+        std::function<void()> task;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                available.wait(guard, [this] {return stop || !tasks.empty();});
+                if(stop && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if(--pending == 0) {
+                    finished.notify_all();
+                }
+            }
+        }
+    }
+
+public:
+    explicit thread_pool(uint32_t num_threads):
+            pending(0),
+            stop(false)
+    {
+        for (uint32_t i = 0; i < num_threads; ++i) {
+            workers.emplace_back(&thread_pool::work, this);
+        }
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        available.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+    @return the number of worker threads
+    */
+    uint32_t size() { return workers.size(); }
+
+    /**
+    Applies a function to the range [begin, end). The range is split into contiguous chunks
+     (one for each worker) and the call returns once every chunk is complete.
+    @param begin The first index of the range
+    @param end The index after the last index of the range
+    @param fn Function that processes the chunk [lo, hi)
+    */
+    void parallel_for(uint64_t begin, uint64_t end, std::function<void(uint64_t, uint64_t)> const& fn)
+    {
+        if(end <= begin) {
+            return;
+        }
+        uint64_t num_chunks = std::min<uint64_t>(workers.size(), end - begin);
+        uint64_t width = (end - begin + num_chunks - 1) / num_chunks;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (uint64_t lo = begin; lo < end; lo += width) {
+                uint64_t hi = std::min(lo + width, end);
+                tasks.push([&fn, lo, hi] {fn(lo, hi);});
+                pending++;
+            }
+        }
+        available.notify_all();
+
+        // barrier: wait for every chunk to complete
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [this] {return pending == 0;});
+    }
+};
+
+/**
+    Applies a function to the range [begin, end) with a pool, or on the calling thread if there is no pool.
+    @param pool The pool (nullptr if single threaded)
+    @param begin The first index of the range
+    @param end The index after the last index of the range
+    @param fn Function that processes the chunk [lo, hi)
+*/
+inline void parallel_for(thread_pool *pool, uint64_t begin, uint64_t end,
+        std::function<void(uint64_t, uint64_t)> const& fn)
+{
+    if(pool != nullptr) {
+        pool->parallel_for(begin, end, fn);
+    } else if(begin < end) {
+        fn(begin, end);
+    }
+}
+
+#endif //MY_PROJECT_THREAD_POOL_H